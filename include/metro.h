@@ -1,11 +1,24 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-#define  ENABLE_CDSTRUCT    0
-
 #include <iostream>
 #include <sstream>
 #include <cstdio>
@@ -42,111 +55,52 @@
 #define _RGB  MAKE_COLOR
 #define _BRGB MAKE_BK_COLOR
 
-#define TAG_ALERT       COL_YELLOW  "#alert"
-#define TAG_ALERTMSG    COL_MAGENTA "#alertmsg "
-#define TAG_ALERTCTOR   _RGB(100,200,255) "#Contruct"
-#define TAG_ALERTDTOR   _RGB(200,150,60)  "#Destruct"
-#define TAG_TODOIMPL    _RGB(50,255,255)  "#not implemented here"
-#define TAG_PANIC       COL_RED "panic! "
-
-#ifdef _METRO_DEBUG_
-
-  #define debug(...) __VA_ARGS__
-
-  #define _streamalert(tag,e...) \
-    ({ std::stringstream ss; \
-      ss << e; \
-    _alert_impl(tag, ss.str().c_str(), \
-    __FILE__, __LINE__); })
-
-  #define alert \
-    _alert_impl(TAG_ALERT, nullptr, __FILE__, __LINE__)
-
-  #define alertmsg(e...) \
-    _streamalert(TAG_ALERTMSG, COL_WHITE << e)
-
-  #if ENABLE_CDSTRUCT
-    #define alert_ctor \
-      _streamalert(TAG_ALERTCTOR, \
-        __func__ << "  " << this)
-
-    #define alert_dtor \
-      _streamalert(TAG_ALERTDTOR, __func__ << " " << this)
+/*
+ * logging ( see log.cpp )
+ *
+ * records below METRO_LOG_LEVEL are removed at compile time.
+ * "{}" in the format is replaced by the next argument.
+ *
+ *   log_info("loaded {} operations from '{}'", n, path);
+ */
+#ifndef METRO_LOG_LEVEL
+  #ifdef _METRO_DEBUG_
+    #define METRO_LOG_LEVEL   1   // debug
   #else
-    #define alert_ctor  0
-    #define alert_dtor  0
+    #define METRO_LOG_LEVEL   2   // info
   #endif
+#endif
 
-  #define todo_impl \
-    _alert_impl(TAG_TODOIMPL,nullptr,__FILE__,__LINE__), \
-    exit(1)
-
-  #define panic(e...) \
-    {_streamalert(TAG_PANIC,e); std::exit(222);}
-
-  inline char*
-  _make_location_str(char* buf, char const* file, size_t line) {
-    auto sp = strchr(file, '/');
-
-    while( sp )
-      if( auto p = strchr(sp + 1, '/'); p )
-        sp = p + 1;
-      else
-        break;
-
-    sprintf(buf, "%s:%zu:", sp ? sp : file, line);
-    return buf;
-  }
-
-  inline void
-  _alert_impl(  char const* tag, char const* msg,
-                char const* file, size_t line) {
-    char buf[0x100];
-    char buf2[0x400] { ' ' };
-
-    _make_location_str(buf, file, line);
-    size_t len = sprintf(buf2,
-      COL_BOLD _BRGB(20,20,20)
-        "        %s%-30s %s %s",
-      _RGB(150, 255, 0),
-      buf,
-      tag,
-      msg ? msg : ""
-    );
-
-    size_t endpos = 200;
-
-    for(size_t i=0;i<len;){
-      if(buf2[i]=='\033'){
-        do{
-          endpos++;
-          i++;
-        }while(buf2[i]!='m');
-      }
-      else {
-        i++;
-      }
-    }
+#define _metro_log(lv, fmt, ...) \
+  do { \
+    if constexpr( (int)(lv) >= METRO_LOG_LEVEL ) { \
+      static constexpr metro::log::Site _log_site{ lv, __FILE__, __LINE__, fmt }; \
+      metro::log::write(_log_site __VA_OPT__(,) __VA_ARGS__); \
+    } \
+  } while( 0 )
 
-    memset(buf2 + len, ' ', 0x400-len);
-    buf2[endpos] = 0;
+#define log_trace(fmt, ...)   _metro_log(metro::log::Level::Trace, fmt __VA_OPT__(,) __VA_ARGS__)
+#define log_debug(fmt, ...)   _metro_log(metro::log::Level::Debug, fmt __VA_OPT__(,) __VA_ARGS__)
+#define log_info(fmt, ...)    _metro_log(metro::log::Level::Info, fmt __VA_OPT__(,) __VA_ARGS__)
+#define log_warn(fmt, ...)    _metro_log(metro::log::Level::Warn, fmt __VA_OPT__(,) __VA_ARGS__)
+#define log_error(fmt, ...)   _metro_log(metro::log::Level::Error, fmt __VA_OPT__(,) __VA_ARGS__)
 
-    printf("%s" COL_DEFAULT "\n", buf2);
-  }
+#ifdef _METRO_DEBUG_
+  #define debug(...) __VA_ARGS__
+  #define _METRO_PANIC_EXIT   222
 #else
   #define debug(...)      ;
-  #define alert           (void)0
-  #define alertmsg(...)   (void)0
-  #define alert_ctor      (void)0
-  #define alert_dtor      (void)0
-
-  #define todo_impl \
-    { printf("%s:%d: todo_impl\n",__FILE__,__LINE__),std::exit(1); }
-  
-  #define panic(...) \
-    { printf("%s:%d: panic!\n",__FILE__,__LINE__),std::exit(1); }
+  #define _METRO_PANIC_EXIT   1
 #endif
 
+// buffered records are written before exit
+#define todo_impl \
+  metro::log::fatal(__FILE__, __LINE__, "not implemented here", 1)
+
+#define panic(e...) \
+  { std::ostringstream _ss; _ss << e; \
+    metro::log::fatal(__FILE__, __LINE__, "panic! " + _ss.str(), _METRO_PANIC_EXIT); }
+
 #define   GETMASK(T)  (~((uint64_t)-1 << sizeof(T)))
 #define   BIT(N)      (1 << N)
 
@@ -160,8 +114,104 @@ typedef uint16_t  u16;
 typedef uint32_t  u32;
 typedef uint64_t  u64;
 
+namespace metro::log {
+
+enum class Level : u8 {
+  Trace,
+  Debug,
+  Info,
+  Warn,
+  Error,
+  Fatal,
+};
+
+// one for each call site
+struct Site {
+  Level         level;
+  char const*   file;
+  u32           line;
+  char const*   format;
+};
+
+/*
+ * arguments of a record, in binary.
+ *   | tag : u8 | u64 / double      |
+ *   | tag : u8 | length : u16 | bytes |   ( string, truncated )
+ */
+class Encoder {
+public:
+  enum class Tag : u8 {
+    Unsigned,
+    Signed,
+    Float,
+    Bool,
+    Pointer,
+    String,
+  };
+
+  static constexpr size_t Capacity = 480;
+
+  u8      buf[Capacity];
+  size_t  size = 0;
+
+  template <class T>
+  void add(T const& v) {
+    if constexpr( std::is_same_v<T, bool> )
+      this->scalar(Tag::Bool, &v, 1);
+    else if constexpr( std::is_enum_v<T> )
+      this->add(static_cast<std::underlying_type_t<T>>(v));
+    else if constexpr( std::is_integral_v<T> ) {
+      u64 x = static_cast<u64>(v);
+      this->scalar(std::is_signed_v<T> ? Tag::Signed : Tag::Unsigned, &x, sizeof(x));
+    }
+    else if constexpr( std::is_floating_point_v<T> ) {
+      double d = v;
+      this->scalar(Tag::Float, &d, sizeof(d));
+    }
+    else if constexpr( std::is_convertible_v<T const&, std::string_view> )
+      this->string(v);
+    else if constexpr( std::is_pointer_v<T> ) {
+      u64 x = reinterpret_cast<uintptr_t>(v);
+      this->scalar(Tag::Pointer, &x, sizeof(x));
+    }
+    else
+      static_assert(!sizeof(T), "cannot log this type");
+  }
+
+private:
+  void scalar(Tag tag, void const* p, size_t n);
+  void string(std::string_view s);
+};
+
+void commit(Site const& site, Encoder const& args);
+
+template <class... Args>
+void write(Site const& site, Args const&... args) {
+  Encoder enc;
+
+  (enc.add(args), ...);
+  commit(site, enc);
+}
+
+// write all buffered records now
+void flush();
+
+// default is stderr
+void set_output(FILE* fp);
+
+// records lost to full buffers
+u64 dropped();
+
+[[noreturn]] void fatal(char const* file, u32 line, std::string const& msg, int code);
+
+} // namespace metro::log
+
 namespace metro {
 
+namespace simd {
+  struct Kernels;
+}
+
 namespace vm {
 
 /*
@@ -190,6 +240,8 @@ struct Asm {
     Lst,        // lst    rDest, rA, rB   @ rDest = rA << rB
     Rst,        // rst    rDest, rA, rB   @ rDest = rA >> rB
 
+    And,        // and    rDest, rA, rB   @ rDest = rA & rB
+
     /*
      * load / store
      *
@@ -202,6 +254,17 @@ struct Asm {
     Load,       // ldr    rA, [rAddr, #offs], #N  @ rA = *(rAddr + offs); rAddr += N
     Store,      // str    rA, [rAddr, #offs], #N  @ *(rAddr + offs) = rA; rAddr += N
 
+    /*
+     * address of data
+     *
+     * .value = offset in the data segment
+     *
+     * ldr / str にラベルを書いた場合は adr ip, <label> に展開されます
+     *   ldr  rA, [<label>, #offs]  =>  adr ip, <label>
+     *                                 ldr rA, [ip, #offs]
+     */
+    Adr,        // adr    rd, <label>  @ rd = &label
+
     /* push / pop */
     Push,       // push   rA
     Pop,        // pop    rA
@@ -209,22 +272,68 @@ struct Asm {
     /* Branch */
     Call,       // call   <label>
     Jump,       // jmp    <label>
-    Jumpx,      // jx     rA
+    Jumpx,      // jx     rA       @ .value = jump site number ( by linker )
+    Ret,        // ret             @ pc = top of return stack
 
     // system call
     SysCall,    // sys #value
 
     /*
-     * Place a data.
+     * atomic
      *
-     * アセンブリでの記述は DataType のメンバーを小文字で書いたものと同じ
+     * 64bit, address must be aligned to 8 ( or fault ).
+     * all of them are sequentially consistent. ldr / str are not atomic,
+     * and are ordered between threads only by these and fence.
      */
-    Data,
+    Cas,        // cas    rd, ra, [rb]  @ if [rb] == rd then [rb] = ra.  rd = old [rb]
+    Xadd,       // xadd   rd, ra, [rb]  @ rd = [rb], [rb] += ra
+    Xchg,       // xchg   rd, ra, [rb]  @ rd = [rb], [rb] = ra
+    Fence,      // fence
+
+    /*
+     * vector (256bit)
+     *
+     * lane type is given by suffix like ldr / str, and set to .data_type
+     *   vaddb = u8 x 32,  vaddh = u16 x 16,  vaddw = u32 x 8,  vaddu = u64 x 4
+     *
+     * VLoad / VStore:  same member allocation as Load / Store
+     */
+    VLoad,      // vld    vA, [rAddr, #offs], #N
+    VStore,     // vst    vA, [rAddr, #offs], #N
+    VDup,       // vdup   vDest, rA       @ all lanes = rA
+    VAdd,       // vadd   vDest, vA, vB
+    VSub,       // vsub   vDest, vA, vB
+    VMul,       // vmul   vDest, vA, vB   @ low half of product
+    VAnd,       // vand   vDest, vA, vB
+    VCmpEq,     // vceq   vDest, vA, vB   @ lane = vA == vB ? ~0 : 0
+    VCmpGt,     // vcgt   vDest, vA, vB   @ lane = vA > vB ? ~0 : 0  (unsigned)
+    VSum,       // vsum   rDest, vA       @ rDest = sum of lanes
+    VMax,       // vmax   rDest, vA       @ rDest = max of lanes (unsigned)
+
+    /*
+     * division by a constant, made by the optimizer.  (no syntax)
+     *
+     * member allocation:
+     *  .value  = magic
+     *  .rb     = shift | (add ? 0x80 : 0)
+     *
+     *  q = mulhi(rA, magic)
+     *  rDest = add ? (((rA - q) >> 1) + q) >> shift : q >> shift
+     */
+    DivMagic,
+
+    Nop,
 
     Label,
 
   };
 
+  /*
+   * Data directives ( .byte, .harf, ... ) are not placed in the codes.
+   * The assembler lays them out in the data segment of vm::Image.
+   *
+   * アセンブリでの記述は DataType のメンバーを小文字で書いたものと同じ
+   */
   enum class DataType {
     Byte,     // u8
     Harf,     // u16
@@ -250,7 +359,6 @@ struct Asm {
   union {
     u64     value;
     u16     reglist;  // rN = (1 << N)
-    void*   data;
   };
 
   std::string str; // label, attr
@@ -281,6 +389,45 @@ struct Asm {
 
 };
 
+/*
+ * Linked program.
+ *
+ * codes:
+ *   operands of call / jmp / adr are already resolved to the index of
+ *   codes / offset in data by the linker.
+ *
+ * data:
+ *   All of .byte / .harf / .word / .long / .string are placed
+ *   in one contiguous segment. Each item is aligned to its natural size,
+ *   and a label just before a data directive refers to the offset.
+ */
+struct Image {
+  std::vector<Asm>  codes;
+  std::vector<u8>   data;
+
+  // global code labels => index of codes
+  std::map<std::string, u64, std::less<>> entries;
+
+  // data labels => offset in data, local ones as "<index of object>:<name>"
+  std::map<std::string, u64, std::less<>> data_labels;
+
+  // count of jx ( Jumpx::value is 0 .. jump_sites - 1 )
+  size_t jump_sites = 0;
+
+  // names of host system calls ( SysCall::value = ByName + index )
+  std::vector<std::string> sys_names;
+};
+
+/*
+ * vector register
+ */
+union alignas(32) VReg {
+  u8    b[32];
+  u16   h[16];
+  u32   w[8];
+  u64   u[4];
+};
+
 struct VCPU {
   union {
     u64   registers[16] { };
@@ -295,11 +442,417 @@ struct VCPU {
     };
   };
 
+  VReg  vregs[16] { };
+
+  /*
+   * return stack
+   *
+   * call pushes pc + 1 ( and sets lr as before ), ret pops it.
+   * jx to the top entry ( jx lr ) pops it too, so old code stays balanced.
+   * ret on empty stack halts, like jx to lr = -1 at the top level.
+   * a call on a full stack is a fault ( RunStatus::Fault ).
+   */
+  static constexpr size_t ReturnStackDepth = 1024;
+
+  u64   ret_stack[ReturnStackDepth];
+  u32   ret_depth = 0;
+
   VCPU()
   {
   }
 };
 
+/*
+ * Allocator of the guest heap.
+ *
+ * general heap:
+ *   small sizes (<= 2048) are rounded up to a size class and served from
+ *   the free lists of a Cache, which is owned by one thread and takes no lock.
+ *   caches refill from / flush to the central lists of Heap.
+ *   larger sizes are served by Heap directly.
+ *   every block has a 16 bytes header before it ( live / freed mark ).
+ *
+ *   the header and the free-list links are in guest memory, so they are
+ *   never trusted: the class and size of a block are kept on the host
+ *   side, by page of the region ( see Page ), and a pointer is a block
+ *   only at a block boundary of its page.
+ *
+ * arena:
+ *   bump allocation from the end of the region toward the general heap.
+ *   no header, no free. arena_reset() releases all at once.
+ */
+class Heap {
+public:
+  static constexpr size_t Align = 16;
+
+  static constexpr size_t ClassSizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+  };
+
+  static constexpr size_t ClassCount = std::size(ClassSizes);
+
+  // unit of the region given to a class or to a large block
+  static constexpr size_t PageSize = 0x1000;
+
+  struct Page {
+    u32   cls;      // ClassCount = large block
+    u32   run;      // first page of the chunk / large block
+    u32   pages;    // of the run
+  };
+
+  struct Stats {
+    u64   allocs;
+    u64   frees;
+    u64   reallocs;
+    u64   failed;
+
+    u64   class_allocs[ClassCount];
+    u64   large_allocs;
+
+    u64   bytes_in_use;   // general heap, by block size
+    u64   footprint;      // general heap, ever carved from the region
+
+    u64   arena_allocs;
+    u64   arena_resets;
+    u64   arena_bytes;
+    u64   arena_peak;
+  };
+
+  class Cache {
+    friend class Heap;
+
+    Heap*   heap;
+    u8*     free_list[ClassCount] { };
+    u32     count[ClassCount] { };
+    Stats   stats { };
+
+  public:
+    explicit Cache(Heap& heap);
+    ~Cache();
+
+    Cache(Cache const&) = delete;
+    Cache& operator=(Cache const&) = delete;
+
+    // p must be owned by the heap ( or nullptr )
+    void* alloc(size_t size);
+    void free(void* p);
+    void* realloc(void* p, size_t size);
+  };
+
+  /*
+   * state of the heap as offsets from the beginning of the region.
+   * free-list offsets are offset + 1, 0 = empty.
+   */
+  struct State {
+    u64   top;
+    u64   arena;
+    u64   free_list[ClassCount];
+    std::vector<std::pair<u64, u64>> large_free;   // block size, offset
+    std::vector<Page> pages;                      // top / PageSize
+    Stats stats;
+  };
+
+  Heap();
+
+  Heap(Heap const&) = delete;
+  Heap& operator=(Heap const&) = delete;
+
+  /*
+   * use [begin, begin + size) as the heap.
+   * everything allocated before is dropped.
+   */
+  void init(u8* begin, size_t size);
+
+  void* arena_alloc(size_t size);
+  void arena_reset();
+
+  // p is a live block of the general heap
+  bool owns(void const* p) const;
+
+  /*
+   * save() moves blocks cached by every Cache back to the central lists,
+   * so no context may be allocating while it runs.
+   * restore() is init() + the saved state, for a copy of the region.
+   */
+  State save();
+  void restore(u8* begin, size_t size, State const& st);
+
+  Stats stats() const;
+
+private:
+  u8* take(size_t size, size_t cls);
+  void* alloc_large(size_t size, Stats& st);
+  void free_large(u8* block, Stats& st);
+
+  size_t refill(size_t cls, Cache& cache);
+  void flush(size_t cls, Cache& cache, u32 keep);
+  void flush_locked(size_t cls, Cache& cache, u32 keep);
+
+  // page of a block ( header ), nullptr if block is not a block boundary
+  Page const* page_of(u8 const* block) const;
+
+  size_t capacity_of(u8 const* block) const;
+
+  // nullptr at the end of the list, or if the link is not a block of cls
+  u8* next_of(u8* block, size_t cls) const;
+  void set_next(u8* block, u8* next);
+
+  mutable std::mutex mtx;
+
+  u8*   begin;
+  u8*   end;
+  u8*   top;      // general heap grows up
+  u8*   arena;    // arena grows down
+
+  u8*   free_list[ClassCount];
+  std::multimap<size_t, u8*> large_free;
+
+  // [0, used) are valid, written before the blocks in them are handed out
+  std::unique_ptr<Page[]> pages;
+  size_t page_capacity = 0;
+  std::atomic<size_t> pages_used = 0;
+
+  Stats central;
+  std::vector<Cache*> caches;
+};
+
+class Machine;
+
+/*
+ * System call table
+ *
+ * flat table indexed by the number, each entry has a name ( for
+ * "sys <name>" in the assembler ), a handler, a call counter and
+ * a latency histogram.
+ *
+ * global() has the VM's calls ( 0 .. ) and is immutable, so machines
+ * on any thread share it. a host binds its calls on the copy of its
+ * machine ( Machine::on_syscall ), before running it.
+ *
+ * "sys <name>" of a VM call is resolved by the assembler, other names
+ * by each machine on its table, before it runs ( see ByName ).
+ * either way a sys executes as an index into entries.
+ */
+class SysCallTable {
+public:
+  using Handler = std::function<void(Machine&)>;
+
+  static constexpr u64 MaxSysCalls = 0x1000;
+
+  /*
+   * value of a sys by the name of a host call ( Asm::str ).
+   * the linker makes it ByName + index of Image::sys_names.
+   */
+  static constexpr u64 ByName = MaxSysCalls;
+
+  // latency: bucket i = [2^i, 2^(i+1)) nanoseconds
+  static constexpr size_t HistogramBuckets = 32;
+
+  struct Entry {
+    std::string   name;
+    Handler       fn;
+
+    // counted by call(), also on a const table
+    mutable u64   calls = 0;
+    mutable u64   total_ns = 0;
+    mutable u64   histogram[HistogramBuckets] { };
+  };
+
+  // counts of a number and name, summed over tables
+  struct Total {
+    u64           number;
+    std::string   name;
+
+    u64   calls = 0;
+    u64   total_ns = 0;
+    u64   histogram[HistogramBuckets] { };
+  };
+
+  SysCallTable();
+
+  // names and handlers, counted from 0
+  SysCallTable(SysCallTable const& other);
+  SysCallTable& operator=(SysCallTable const&) = delete;
+
+  ~SysCallTable();
+
+  static std::shared_ptr<SysCallTable const> const& global();
+
+  /*
+   * counts of every table: alive, and destroyed ( so totals never go down ).
+   * by number and name, tables of machines can bind different names.
+   */
+  static std::vector<Total> totals();
+
+  void bind(u64 number, std::string name, Handler fn);
+
+  /*
+   * typed: arguments are read from r0, r1, .. by the parameter types
+   * ( integers or pointers, pointers are translated from guest address
+   * and checked for sizeof *p bytes ), the result is written to r0.
+   * a first parameter of Machine& gets the calling machine.
+   */
+  template <class F>
+  void bind_typed(u64 number, std::string name, F fn);
+
+  std::optional<u64> find(std::string_view name) const;
+
+  Entry const* entry(u64 number) const {
+    return number < this->entries.size() && this->entries[number].fn ? &this->entries[number] : nullptr;
+  }
+
+  std::vector<Entry> const& all() const { return this->entries; }
+
+  // a fault of m if not bound
+  void call(u64 number, Machine& m) const;
+
+private:
+  std::vector<Entry> entries;
+  std::map<std::string, u64, std::less<>> names;
+};
+
+/*
+ * Program
+ *
+ * linked code and initial data, immutable once built.
+ * codes are decoded Asm, nothing is parsed while running.
+ * one Program can be shared by any number of machines and threads.
+ */
+class Program {
+public:
+  explicit Program(Image image);
+
+  // assemble and link source files ( or read *.mo ), nullptr on an error
+  static std::shared_ptr<Program const> from_files(std::vector<std::string> const& paths,
+    bool optimize = false);
+
+  Image const& image() const { return this->img; }
+  std::vector<Asm> const& codes() const { return this->img.codes; }
+
+  // index of a global code label
+  std::optional<u64> entry(std::string_view name) const;
+
+private:
+  Image img;
+};
+
+/*
+ * MemoryProfile
+ *
+ * loads and stores of a machine ( opt-in, see Machine::set_profile ),
+ * counted by cache line and page. for each instruction: the strides
+ * between its accesses and the accesses straddling a line.
+ * the working set is sampled every Window accesses.
+ *
+ * addresses are guest addresses. not shared by threads.
+ */
+class MemoryProfile {
+public:
+  static constexpr u64 LineSize = 64;
+  static constexpr u64 PageSize = 4096;
+  static constexpr u64 Window = 1 << 16;        // accesses
+  static constexpr size_t MaxStrides = 8;       // for each instruction
+
+  // an instruction
+  struct Site {
+    u64     loads = 0;
+    u64     stores = 0;
+    u64     straddles = 0;
+    u64     size = 0;     // of the last access
+    u64     last = 0;     // address
+
+    std::map<i64, u64> strides;
+    u64     other_strides = 0;
+  };
+
+  struct Line {
+    u64     loads = 0;
+    u64     stores = 0;
+  };
+
+  struct Sample {
+    u64     accesses;     // at the end of the window
+    u64     lines;
+    u64     pages;
+  };
+
+  void record(u64 pc, u64 addr, u64 size, bool store);
+
+  // hot lines / pages, strides, working set and advice
+  void report(FILE* fp, size_t top = 10) const;
+
+  u64 accesses() const { return this->count; }
+
+private:
+  u64 count = 0;
+
+  std::unordered_map<u64, Line> lines;    // by address / LineSize
+  std::unordered_map<u64, u64> pages;     // by address / PageSize
+  std::map<u64, Site> sites;              // by pc
+
+  std::unordered_set<u64> window_lines;
+  std::unordered_set<u64> window_pages;
+  std::vector<Sample> working_set;
+};
+
+/*
+ * Channel of fixed-size messages between machines.
+ *
+ * bounded ring buffer, lock-free:
+ *   SPSC  one sending thread and one receiving thread
+ *   MPMC  any number of both ( per-slot sequence numbers )
+ *
+ * try_* return false instead of waiting when full / empty.
+ * send / recv wait by spinning, then yielding the host thread.
+ * *_for give up ( false ) after rounds of that.
+ */
+class Channel {
+public:
+  enum class Kind {
+    SPSC,
+    MPMC,
+  };
+
+  static constexpr size_t CacheLine = 64;
+
+  // capacity is rounded up to a power of 2
+  Channel(Kind kind, size_t capacity, size_t message_size);
+
+  Channel(Channel const&) = delete;
+  Channel& operator=(Channel const&) = delete;
+
+  bool try_send(void const* msg);
+  bool try_recv(void* msg);
+
+  void send(void const* msg);
+  void recv(void* msg);
+
+  bool send_for(void const* msg, u32 rounds);
+  bool recv_for(void* msg, u32 rounds);
+
+  Kind kind() const { return this->_kind; }
+  size_t capacity() const { return this->mask + 1; }
+  size_t message_size() const { return this->msg_size; }
+
+private:
+  u8* slot(u64 pos) {
+    return this->buffer.get() + (pos & this->mask) * this->stride;
+  }
+
+  Kind    _kind;
+  size_t  mask;
+  size_t  msg_size;
+  size_t  stride;   // MPMC: u64 sequence + message
+
+  std::unique_ptr<u8[]> buffer;
+
+  alignas(CacheLine) u64 head = 0;      // next to receive
+  u64 tail_cache = 0;                   // SPSC: of receiver
+
+  alignas(CacheLine) u64 tail = 0;      // next to send
+  u64 head_cache = 0;                   // SPSC: of sender
+};
+
 class Machine {
   enum CompareResult {
     None      = 0,
@@ -312,31 +865,507 @@ class Machine {
 
 public:
 
-  Machine()
-  {
+  /*
+   * Host:
+   *   guest address = host pointer. no check.
+   *
+   * Guest:
+   *   guest address = MemoryBase + offset in the memory of this machine.
+   *   every access is checked, out of range is a fault.
+   */
+  enum class MemoryMode {
+    Host,
+    Guest,
+  };
+
+  static constexpr size_t DataAlign = 64; // cache line
+  static constexpr u64 MemoryBase = 0x10000;
+  static constexpr size_t StackSize = 0x1000 * sizeof(u64);
+  static constexpr size_t HeapSize = 64 << 20; // reserved, pages are mapped on use
+
+  /*
+   * Saved state of a machine: VCPU, heap and the whole memory.
+   *
+   * the memory is kept in a memfd. a machine made from a snapshot maps it
+   * MAP_PRIVATE, so pages are shared until written (copy-on-write) and
+   * cloning costs no copy. only Guest mode machines can be saved, since
+   * host addresses would be stale in another mapping.
+   */
+  struct Snapshot {
+    VCPU          cpu;
+    CompareResult cmp_result;
+
+    size_t  memory_size;
+    size_t  data_size;
+    int     fd = -1;
+
+    Heap::State heap;
+
+    // parts of the memory ever written ( offset, size ), the rest is zero
+    std::vector<std::pair<u64, u64>> ranges;
+
+    Snapshot() = default;
+    Snapshot(Snapshot const&) = delete;
+    Snapshot& operator=(Snapshot const&) = delete;
+
+    ~Snapshot();
+  };
+
+  Machine(MemoryMode mode = MemoryMode::Host);
+
+  // Guest mode machine with the state of snap
+  explicit Machine(Snapshot const& snap);
+
+  Machine(Machine const&) = delete;
+  Machine& operator=(Machine const&) = delete;
+
+  ~Machine();
+
+  /*
+   * copy the data segment of image into this machine.
+   */
+  void load(Image const& image);
+
+  /*
+   * jx sites and host system call names of image, for running its codes.
+   * load() does it, a machine from a snapshot has only the data.
+   */
+  void link(Image const& image);
+
+  /*
+   * load the program, and run it by run(budget) / execute(entry).
+   * the machine keeps a reference to it.
+   */
+  void load(std::shared_ptr<Program const> prog);
+
+  using Clock = std::chrono::steady_clock;
+
+  enum class RunStatus {
+    Halted,     // jumped to -1, or ran off the end
+    OutOfFuel,  // run() again to continue
+    Deadline,   // run() again to continue
+    Fault,      // stopped by fault(), pc is at the instruction
+  };
+
+  /*
+   * limits of one run().
+   *
+   * fuel is counted in instructions but charged per basic block, at each
+   * call / jump / ret and any other write to pc, so a run stops at the
+   * first of them after the fuel is used up. the deadline is checked
+   * every DeadlineInterval of them.
+   *
+   * stop is set by another thread to end the run at the next block end
+   * ( RunStatus::Deadline ).
+   */
+  struct Budget {
+    u64               fuel = ~(u64)0;
+    Clock::time_point deadline = Clock::time_point::max();
+
+    std::atomic<bool> const* stop = nullptr;
+
+    bool limited() const {
+      return this->fuel != ~(u64)0 || this->deadline != Clock::time_point::max() || this->stop;
+    }
+  };
+
+  static constexpr u32 DeadlineInterval = 1024;
+
+  /*
+   * inline cache of a jx.
+   *
+   * up to JumpCacheSize targets seen at the site are kept ( monomorphic,
+   * then polymorphic ). a target is validated on its miss only, a hit
+   * goes to it directly. a target that does not fit anymore is a miss
+   * every time ( megamorphic ).
+   */
+  static constexpr size_t JumpCacheSize = 4;
+
+  struct JumpSite {
+    u64   pc = (u64)-1;     // of the jx, -1 = not executed
+    u64   targets[JumpCacheSize];
+    u32   count = 0;
+    u64   hits = 0;
+    u64   misses = 0;
+
+    bool holds(u64 target) const {
+      for( u32 i = 0; i < this->count; i++ ) {
+        if( this->targets[i] == target )
+          return true;
+      }
+
+      return false;
+    }
+  };
+
+  /*
+   * execute asm operations from codes[entry] until halted.
+   * registers other than sp, lr, pc are kept from the last run.
+   */
+  void execute_code(std::vector<Asm> const& codes, u64 entry = 0);
+
+  /*
+   * start() sets sp, lr, pc to run from codes[entry].
+   * run() continues from cpu.pc within budget; codes must not change
+   * between runs of one program.
+   */
+  void start(u64 entry = 0);
+  RunStatus run(std::vector<Asm> const& codes, Budget const& budget);
+
+  /*
+   * features of the dispatch loop, fixed at compile time.
+   *   Mode          memory model ( Guest checks every access )
+   *   Instrumented  loads / stores are recorded to profile
+   *   Metered       fuel and deadline of the budget are checked
+   *
+   * select_policy() picks the instantiations for the memory mode and
+   * profile when the machine is made ( and by set_profile() ); run()
+   * calls the metered one only for a budget with limits.
+   */
+  template <MemoryMode Mode, bool Instrumented, bool Metered>
+  struct Policy {
+    static constexpr MemoryMode mode = Mode;
+    static constexpr bool instrumented = Instrumented;
+    static constexpr bool metered = Metered;
+  };
+
+  using Runner = RunStatus (Machine::*)(std::vector<Asm> const&, Budget const&);
+
+  template <class P>
+  RunStatus run_with(std::vector<Asm> const& codes, Budget const& budget);
+
+  void select_policy();
+
+  // nullptr to stop recording
+  void set_profile(MemoryProfile* prof);
+
+  RunStatus run(std::vector<Asm> const& codes) {
+    return this->run(codes, Budget{ });
   }
 
-  ~Machine()
-  {
+  // with the loaded program
+  RunStatus run(Budget const& budget) {
+    return this->run(this->program->codes(), budget);
+  }
+
+  void execute(u64 entry = 0) {
+    this->execute_code(this->program->codes(), entry);
+  }
+
+  /*
+   * host system call
+   *
+   * the handler reads arguments from / writes results to the registers
+   * of the machine given ( can be a thread of this ).
+   * numbers below HostSysCallBase are of the VM.
+   * the first call makes a copy of the global table for this machine.
+   * a name is for "sys <name>", resolved at the start of the next run.
+   * a handler other than SysCallHandler is bound typed ( see
+   * SysCallTable::bind_typed ).
+   */
+  using SysCallHandler = SysCallTable::Handler;
+
+  static constexpr u64 HostSysCallBase = 0x100;
+
+  void on_syscall(u64 number, SysCallHandler handler);
+  void on_syscall(u64 number, std::string name, SysCallHandler handler);
+
+  template <class F>
+    requires (!std::is_convertible_v<F, SysCallHandler>)
+  void on_syscall(u64 number, F fn) {
+    this->on_syscall(number, "", std::move(fn));
+  }
+
+  template <class F>
+    requires (!std::is_convertible_v<F, SysCallHandler>)
+  void on_syscall(u64 number, std::string name, F fn) {
+    this->own_syscalls_for(number).bind_typed(number, std::move(name), std::move(fn));
+  }
+
+  // table of the root to bind number on, copied from global() at first
+  SysCallTable& own_syscalls_for(u64 number);
+
+  /*
+   * numbers of host "sys <name>" by index of Image::sys_names, resolved
+   * on the table at the start of a run, after load(), reload and
+   * on_syscall. a name not bound then is a fault.
+   */
+  void resolve_syscalls();
+
+  std::vector<std::string> sys_names;
+  std::vector<u64> sys_numbers;
+  bool sys_resolved = true;
+
+  /*
+   * save the state after the last execution.
+   * nullptr in Host memory mode, with threads, or if the memfd fails.
+   */
+  std::shared_ptr<Snapshot const> snapshot();
+
+  /*
+   * hot reload
+   *
+   * reload() queues next, and it replaces the running program at the
+   * next safe point: a call, or the start of a run() ( after a yield by
+   * fuel / deadline ). memory, stack and registers are kept.
+   *
+   * pc and the return stack are remapped by the global label of the
+   * function and the offset in it. a function with a frame ( other than
+   * at its label ) must be unchanged in next, otherwise the reload waits
+   * for a later safe point. lr is remapped the same way, or cleared.
+   *
+   * the data segment is not copied: every data label of next must be at
+   * the same offset in the current program, and the data no larger.
+   * code addresses in other registers or in memory are not remapped, so
+   * each label taken by "mov rN, <label>" must keep its index in next.
+   * threads run the old program, the reload waits until all are joined.
+   * returns false if this is not a root machine running a Program, or
+   * next breaks one of these.
+   */
+  bool reload(std::shared_ptr<Program const> next);
+
+  // called at a safe point, true if the program is replaced
+  bool apply_reload(std::vector<Asm> const& running);
+
+  /*
+   * guest address => host pointer of size bytes.
+   */
+  template <MemoryMode Mode>
+  u8* host_ptr(u64 addr, size_t size) {
+    if constexpr( Mode == MemoryMode::Guest ) {
+      if( size > this->memory_size || addr - this->memory_base > this->memory_size - size )
+        this->fault(addr, size);
+    }
+
+    return this->memory + (addr - this->memory_base);
+  }
+
+  u8* host_ptr(u64 addr, size_t size) {
+    if( this->mode == MemoryMode::Guest )
+      return this->host_ptr<MemoryMode::Guest>(addr, size);
+
+    return this->host_ptr<MemoryMode::Host>(addr, size);
+  }
+
+  u64 guest_addr(u8 const* p) const {
+    return this->memory_base + (p - this->memory);
   }
 
   /*
-   * execute asm operations.
+   * guest address => host pointer of a live heap block.
+   * anything else is a fault.
+   */
+  u8* heap_ptr(u64 addr);
+
+  // jx target not in the cache of the site: validated, then cached
+  void jump_miss(Asm const& op, u64 target, size_t code_size);
+
+  /*
+   * error of the guest ( bad memory access, return stack overflow, .. ).
+   * the running run() returns RunStatus::Fault with the reason in
+   * last_fault; the host process goes on.
    */
-  void execute_code(std::vector<Asm> const& codes);
+  struct GuestFault { };
+
+  [[noreturn]]
+  void fault(std::string reason);
+
+  [[noreturn]]
+  void fault(u64 addr, size_t size);
+
+  std::string last_fault;
 
 
 //private:
 
+  void map_memory(size_t data_size);
+  void set_layout(size_t data_size);
+
   VCPU cpu;
   CompareResult cmp_result;
 
-  u64 stack[0x1000];
+  u64 fuel_used = 0;  // by the last run()
+
+  // kernels of vector instructions, nullptr = best for this host
+  simd::Kernels const* kernels = nullptr;
+
+  /*
+   * guest threads ( sys #10 spawn, sys #11 join )
+   *
+   * a thread is a Machine sharing memory and heap with the root machine,
+   * with its own VCPU, heap cache and a stack allocated from the heap.
+   * all threads are owned by the root, which stops and joins them when
+   * destroyed.
+   *
+   * a thread runs with the budget of the run() that spawned it ( the same
+   * fuel for each thread, the same deadline ) and the stop flag of the
+   * root. join of a thread that did not halt is a fault, as is a join of
+   * itself or of a thread already being joined.
+   */
+  struct Thread {
+    std::unique_ptr<Machine> machine;
+    std::thread thread;
+    RunStatus status = RunStatus::Halted;   // at the end of the thread
+    bool joined = false;                    // a join() waits for it
+  };
+
+  // thread of root, to run from stack
+  Machine(Machine& root, u8* stack);
+
+  u64 spawn(std::vector<Asm> const& codes, u64 entry, u64 arg);
+  u64 join(u64 id);
+  void join_all();
+
+  // aligned u64 at guest address, for atomic operations
+  u64& atomic_word(u64 addr);
+
+  /*
+   * channels ( sys #12 .. #15 )
+   *
+   * attach before running, returns the number used by the guest.
+   * threads use the channels of the root.
+   */
+  u64 attach(std::shared_ptr<Channel> ch);
+  Channel& channel(u64 index);
+
+  std::vector<std::shared_ptr<Channel>> channels;   // of root
+
+  std::shared_ptr<SysCallTable const> syscalls = SysCallTable::global();   // of root
+  std::shared_ptr<SysCallTable> own_syscalls;     // of root, after on_syscall
 
+  std::vector<Asm> const* codes = nullptr;    // running
 
+  // by Jumpx::value, targets validated for the codes at jump_codes
+  std::vector<JumpSite> jump_sites;
+  std::vector<Asm> const* jump_codes = nullptr;
 
+  std::shared_ptr<Program const> program;
+
+  // hot reload
+  std::mutex reload_mtx;
+  std::atomic<bool> reload_requested = false;
+  std::shared_ptr<Program const> next_program;
+  std::shared_ptr<Program const> retired;   // replaced by the last reload
+  u64 reloads = 0;
+
+  Machine* root = this;
+
+  std::mutex thread_mtx;              // of root
+  std::map<u64, Thread> threads;      // of root
+  u64 next_thread_id = 1;             // of root
+  std::atomic<bool> stopping = false; // of root, ends all threads
+
+  u64 thread_id = 0;                  // 0 = root
+  u64 joining = 0;                    // thread waited by join()
+
+  Budget const* budget = nullptr;     // of the running run()
+
+  /*
+   * set by a system call that has to wait, in a run with a budget.
+   * the sys ends the block and is executed again after the budget check.
+   */
+  bool retry = false;
+
+  MemoryMode mode;
+
+  /*
+   * memory of this machine
+   *
+   *  | data (DataAlign) | heap (HeapSize) | stack (StackSize) |
+   */
+  u8*     memory;
+  size_t  memory_size;
+  u64     memory_base;  // guest address of memory[0]
+
+  u8*     data;       // data segment (aligned to DataAlign)
+  size_t  data_size;
+
+  u64*    stack;
+
+  std::shared_ptr<Heap> heap = std::make_shared<Heap>();   // shared with threads
+  Heap::Cache heap_cache{ *heap };
+
+private:
+  // records loads / stores if not nullptr, by set_profile() ( not inherited by threads )
+  MemoryProfile* profile = nullptr;
+
+  // of the memory mode and profile, not metered / metered
+  Runner runners[2] { };
 };
 
+namespace detail {
+
+// next argument of type T, from r[reg++]
+template <class T>
+T syscall_arg(Machine& m, size_t& reg) {
+  if constexpr( std::is_same_v<T, Machine&> )
+    return m;
+  else {
+    u64 value = m.cpu.registers[reg++];
+
+    if constexpr( std::is_pointer_v<T> ) {
+      using U = std::remove_cv_t<std::remove_pointer_t<T>>;
+
+      if constexpr( std::is_void_v<U> )
+        return value ? (T)m.host_ptr(value, 1) : nullptr;
+      else
+        return value ? (T)m.host_ptr(value, sizeof(U)) : nullptr;
+    }
+    else
+      return (T)value;
+  }
+}
+
+template <class R, class... Args>
+struct syscall_traits_base {
+  using result = R;
+  using args = std::tuple<Args...>;
+};
+
+template <class F>
+struct syscall_traits : syscall_traits<decltype(&F::operator())> { };
+
+template <class R, class... Args>
+struct syscall_traits<R (*)(Args...)> : syscall_traits_base<R, Args...> { };
+
+template <class C, class R, class... Args>
+struct syscall_traits<R (C::*)(Args...) const> : syscall_traits_base<R, Args...> { };
+
+template <class C, class R, class... Args>
+struct syscall_traits<R (C::*)(Args...)> : syscall_traits_base<R, Args...> { };
+
+template <class F, class... Args>
+void syscall_invoke(F& fn, [[maybe_unused]] Machine& m, std::tuple<Args...>*) {
+  [[maybe_unused]] size_t reg = 0;
+
+  // braced list: evaluated from left
+  std::tuple<Args...> args{ syscall_arg<Args>(m, reg)... };
+
+  if constexpr( std::is_void_v<typename syscall_traits<F>::result> )
+    std::apply(fn, args);
+  else
+    m.cpu.registers[0] = (u64)std::apply(fn, args);
+}
+
+} // namespace detail
+
+template <class F>
+void SysCallTable::bind_typed(u64 number, std::string name, F fn) {
+  using Args = typename detail::syscall_traits<F>::args;
+
+  static_assert(std::tuple_size_v<Args> <= 16, "too many arguments");
+
+  this->bind(number, std::move(name), [fn] (Machine& m) mutable {
+    detail::syscall_invoke(fn, m, (Args*)nullptr);
+  });
+}
+
+/*
+ * snapshot file (*.msnap), for skipping the init phase in a new process.
+ */
+bool write_snapshot(std::string const& path, Machine::Snapshot const& snap);
+bool read_snapshot(std::shared_ptr<Machine::Snapshot const>& out, std::string const& path);
+
 } // namespace vm
 
 
@@ -359,14 +1388,338 @@ class Assembler {
 
 
 
+namespace simd {
+
+enum class Backend {
+  Scalar,
+  SSE2,
+  AVX2,
+};
+
+/*
+ * Kernels of vector instructions.
+ * arrays are indexed by the lane type (Asm::DataType, Byte .. Long).
+ */
+struct Kernels {
+  using Binary = void (*)(vm::VReg&, vm::VReg const&, vm::VReg const&);
+  using Reduce = u64 (*)(vm::VReg const&);
+
+  Backend backend;
+
+  Binary  add[4];
+  Binary  sub[4];
+  Binary  mul[4];
+  Binary  cmpeq[4];
+  Binary  cmpgt[4];
+  Binary  band;
+
+  Reduce  sum[4];
+  Reduce  max[4];
+};
+
+/*
+ * best kernels for this host. (detected at the first call)
+ */
+Kernels const& kernels();
+
+/*
+ * kernels of the backend, or nullptr if the host cannot run it.
+ */
+Kernels const* kernels(Backend backend);
+
+char const* backend_name(Backend backend);
+
+} // namespace simd
+
+namespace utf {
+
+static constexpr size_t npos = (size_t)-1;
+
+/*
+ * UTF-8 => UTF-16
+ *
+ * out must have room for len code units.
+ * returns the number of code units written, or npos if in is not valid UTF-8.
+ *
+ * utf8_to_utf16 uses AVX2 / SSE2 for runs of ASCII (selected at runtime),
+ * utf8_to_utf16_reference is the plain scalar decoder.
+ */
+size_t utf8_to_utf16(char16_t* out, u8 const* in, size_t len);
+size_t utf8_to_utf16_reference(char16_t* out, u8 const* in, size_t len);
+
+bool utf8_to_utf16(std::u16string& out, std::string_view in);
+
+} // namespace utf
+
 namespace assembler {
 
-std::vector<vm::Asm> assemble_from_file(std::string const& path);
+/*
+ * Relocatable object.  (*.mo)
+ *
+ * symbols:
+ *   labels defined in this object.
+ *   code label = index of the operation after the label,
+ *   data label = offset in data.
+ *   ".global <name>" exports the label to the other objects.
+ *
+ * relocs:
+ *   codes[index].value <= address of the symbol name. (call, jmp, adr)
+ *   the linker looks up this object first, and then exported symbols.
+ */
+struct Object {
+  enum class Section : u8 {
+    Code,
+    Data,
+  };
+
+  struct Symbol {
+    std::string name;
+    Section     section;
+    u64         offset;
+    bool        global;
+  };
+
+  struct Reloc {
+    size_t      index;
+    Section     section;
+    std::string name;
+  };
+
+  u64 source_hash = 0;  // to skip re-assembling unchanged source
+
+  std::vector<vm::Asm>  codes;
+  std::vector<u8>       data;
+  std::vector<Symbol>   symbols;
+  std::vector<Reloc>    relocs;
+};
+
+/*
+ * error in a source or an object ( message is for the user ).
+ * thrown by assemble_* and linker::link.
+ */
+struct Error : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+u64 hash_source(std::string_view source);
+
+Object assemble_object(std::string const& path);
+
+bool write_object(std::string const& path, Object const& obj);
+bool read_object(Object& out, std::string const& path);
+
+/*
+ * assemble the file at path, or read obj_path instead if it was made
+ * from the same source.  the object file is updated when re-assembled.
+ */
+Object assemble_cached(std::string const& path, std::string const& obj_path);
+
+/*
+ * assemble and link a single file.
+ */
+vm::Image assemble_from_file(std::string const& path);
 
 bool assemble_full(std::vector<u8>& out, std::vector<vm::Asm> const& codes);
 
 } // namespace assembler
 
+namespace linker {
+
+/*
+ * combine objects into one image.
+ * codes and data are placed in the order of objects; execution starts at
+ * the first operation of objects[0].
+ */
+vm::Image link(std::vector<assembler::Object> const& objects);
+
+} // namespace linker
+
+namespace optimizer {
+
+/*
+ * A transform on linked codes.
+ *
+ * A pass removes an operation by replacing it with Asm::Kind::Nop;
+ * PassManager drops them and fixes jump targets at the end.
+ * run() returns the number of operations changed (including removed).
+ */
+class Pass {
+public:
+  virtual ~Pass() = default;
+
+  virtual char const* name() const = 0;
+  virtual size_t run(std::vector<vm::Asm>& codes) = 0;
+};
+
+struct PassStats {
+  char const* name;
+  double      msec;
+  size_t      rewritten;
+  size_t      removed;
+};
+
+class PassManager {
+public:
+  PassManager& add(std::unique_ptr<Pass> pass);
+
+  /*
+   * run all passes in order.
+   *
+   * jx to a register other than lr may jump to an absolute index,
+   * so codes are not compacted (removed ones stay as Nop) if there is such one.
+   */
+  std::vector<PassStats> run(vm::Image& image);
+
+  size_t removed() const {
+    return this->total_removed;
+  }
+
+private:
+  std::vector<std::unique_ptr<Pass>> passes;
+  size_t total_removed = 0;
+};
+
+std::unique_ptr<Pass> constant_propagation();
+std::unique_ptr<Pass> strength_reduction();
+std::unique_ptr<Pass> dead_store_elimination();
+std::unique_ptr<Pass> dead_code_elimination();
+
+/*
+ * const-prop, strength-reduction, const-prop, dead-store, dead-code
+ */
+PassManager default_pipeline();
+
+} // namespace optimizer
+
+namespace harness {
+
+/*
+ * differential test of the execution engines.
+ *
+ * runs count random programs on every engine ( memory modes, optimizer,
+ * simd backends ), compares the results with the first one, and
+ * reports the time of each. a divergent program is minimized and dumped.
+ * returns the number of divergent programs.
+ */
+size_t differential(size_t count, u64 seed);
+
+} // namespace harness
+
+namespace metrics {
+
+/*
+ * runtime metrics, exported in Prometheus text format.
+ *
+ * each metric has a shard for every thread slot. an update is a relaxed
+ * add to the shard of the calling thread ( no lock, no shared line ),
+ * a read sums the shards.
+ */
+constexpr size_t Shards = 64;
+
+// slot of the calling thread
+size_t shard_index();
+
+class Counter {
+public:
+  void add(u64 n = 1) {
+    this->shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  u64 value() const;
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<u64> value;
+  };
+
+  std::unique_ptr<Shard[]> shards = std::make_unique<Shard[]>(Shards);
+};
+
+// bucket i = [2^i, 2^(i+1)) nanoseconds, as SysCallTable
+class Histogram {
+public:
+  static constexpr size_t Buckets = vm::SysCallTable::HistogramBuckets;
+
+  struct Snapshot {
+    u64   buckets[Buckets];
+    u64   count;
+    u64   sum_ns;
+  };
+
+  void observe(u64 ns);
+  Snapshot read() const;
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<u64> buckets[Buckets];
+    std::atomic<u64> count;
+    std::atomic<u64> sum_ns;
+  };
+
+  std::unique_ptr<Shard[]> shards = std::make_unique<Shard[]>(Shards);
+};
+
+class Registry {
+public:
+  static Registry& global();
+
+  // metrics live as long as the registry
+  Counter& counter(std::string name, std::string help);
+  Histogram& histogram(std::string name, std::string help);
+
+  // registered metrics and SysCallTable::totals()
+  std::string prometheus() const;
+
+private:
+  struct Metric {
+    std::string                 name;
+    std::string                 help;
+    std::unique_ptr<Counter>    counter;
+    std::unique_ptr<Histogram>  histogram;
+  };
+
+  mutable std::mutex mtx;
+  std::vector<Metric> metrics;
+};
+
+// metrics of the VM, in Registry::global().
+// machine counters are added at the end of each run(), not per instruction.
+struct VM {
+  Counter&    instructions;
+  Counter&    branches;
+  Counter&    runs;
+  Counter&    jump_cache_hits;
+  Counter&    jump_cache_misses;
+  Counter&    object_cache_hits;
+  Counter&    object_cache_misses;
+  Counter&    reloads;
+  Histogram&  run_latency;
+  Histogram&  assemble_latency;
+};
+
+VM& vm();
+
+// text of Registry::global()
+std::string prometheus();
+
+/*
+ * hit / miss counters of each jx site of m, as prometheus() text.
+ * read on the thread running m, between runs.
+ */
+std::string jump_sites(vm::Machine const& m);
+
+// written to path.tmp, then renamed, with extra text appended
+bool write_file(std::string const& path, std::string const& extra = "");
+
+/*
+ * listen on a unix socket, every connection gets prometheus() and is
+ * closed. stop_serving() closes the socket.
+ */
+bool serve(std::string const& path);
+void stop_serving();
+
+} // namespace metrics
+
 
 } // namespace metro
 
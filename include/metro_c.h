@@ -0,0 +1,81 @@
+#pragma once
+
+/*
+ * C interface of libmetro
+ *
+ * metro_program: linked program, immutable. can be shared by machines
+ *                on any thread.
+ * metro_machine: state of one execution ( memory, registers ).
+ *                used by one thread at a time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct metro_program metro_program;
+typedef struct metro_machine metro_machine;
+
+enum metro_status {
+  METRO_HALTED,
+  METRO_OUT_OF_FUEL,
+  METRO_DEADLINE,
+  METRO_FAULT,
+};
+
+/*
+ * assemble and link source files ( or *.mo ).
+ * NULL if a file cannot be read, or has an error ( written to the log ).
+ */
+metro_program* metro_program_load(char const* const* paths, size_t count, int optimize);
+void metro_program_free(metro_program* prog);
+
+// index of a global code label, or -1
+int64_t metro_program_entry(metro_program const* prog, char const* name);
+
+// guest != 0: Guest memory mode ( checked accesses )
+metro_machine* metro_machine_new(metro_program const* prog, int guest);
+void metro_machine_free(metro_machine* m);
+
+/*
+ * run from entry, or resume after METRO_OUT_OF_FUEL / METRO_DEADLINE.
+ * fuel = 0: no limit.   timeout_us = 0: no deadline.
+ * METRO_FAULT: the guest did something invalid, pc is at the operation.
+ */
+int metro_machine_start(metro_machine* m, uint64_t entry, uint64_t fuel, uint64_t timeout_us);
+int metro_machine_resume(metro_machine* m, uint64_t fuel, uint64_t timeout_us);
+
+// reason of the last METRO_FAULT, valid until the next run
+char const* metro_machine_fault(metro_machine const* m);
+
+/*
+ * replace the program at the next safe point ( call, or start / resume ),
+ * keeping memory and registers. see Machine::reload.
+ * returns -1 if not possible.
+ */
+int metro_machine_reload(metro_machine* m, metro_program const* prog);
+
+// index = 0 .. 15, returns -1 if not
+int metro_machine_get_reg(metro_machine const* m, int index, uint64_t* value);
+int metro_machine_set_reg(metro_machine* m, int index, uint64_t value);
+
+// host pointer of size bytes at guest address, NULL if out of the memory
+void* metro_machine_ptr(metro_machine* m, uint64_t addr, size_t size);
+
+/*
+ * host system call ( number = 0x100 .. 0xfff ), returns -1 if out of that
+ * or the name is bound to another number.
+ * name ( or NULL ) is for "sys <name>", resolved at the start of the next run.
+ * the handler gets the machine executing it ( can be a guest thread ).
+ */
+typedef void (*metro_syscall_fn)(metro_machine* m, void* user);
+
+int metro_machine_on_syscall(metro_machine* m, uint64_t number, char const* name,
+  metro_syscall_fn fn, void* user);
+
+#ifdef __cplusplus
+}
+#endif
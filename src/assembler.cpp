@@ -1,8 +1,8 @@
 #include <iostream>
+#include <algorithm>
+#include <charconv>
 #include <fstream>
-#include <map>
-#include <codecvt>
-#include <locale>
+#include <unordered_map>
 #include <optional>
 #include "metro.h"
 
@@ -12,8 +12,7 @@ using namespace metro::vm;
 
 [[noreturn]]
 static void Err(std::string const& msg) {
-  std::cout << msg << std::endl;
-  std::exit(1);
+  throw Error(msg);
 }
 
 struct Token {
@@ -21,6 +20,7 @@ struct Token {
     Unknown,
     Ident,
     Register,
+    VRegister,
     Value,
     String,
     Punctuater,
@@ -90,6 +90,11 @@ public:
     return { pos != this->position, this->source.substr(pos, this->position - pos) };
   }
 
+  // "line N" of the current position, for errors
+  std::string where() const {
+    return "line " + std::to_string(std::count(this->source.begin(), this->source.begin() + this->position, '\n') + 1);
+  }
+
   std::string eat_ident() {
     size_t pos = this->position;
 
@@ -129,33 +134,8 @@ public:
 
       auto& token = tokens.emplace_back();
 
-      // register
-      if( this->eat("r") ) {
-        token.kind = Token::Kind::Register;
-        
-        if( auto&& [b, s] = this->eat_digits(); b ) {
-          token.s = 'r' + s;
-
-          int r = std::stoi(s);
-
-          if( r < 0 || r >= 16 ) {
-            Err("invalid register index");
-          }
-
-          token.reg_index = r & 0xFF;
-        }
-        else
-          Err("expected register index after 'r'");
-      }
-
-      // register alias
-      else if( auto [b, i] = std::make_tuple(false, 0); ({for( auto&& [x, y] : register_aliases ) if( this->eat(x) ) { b = true; i = y; break; } }), b ) {
-        token.kind = Token::Kind::Register;
-        token.reg_index = i;
-      }
-
       // value (char)
-      else if( this->eat("#'") ) {
+      if( this->eat("#'") ) {
         token.kind = Token::Kind::Value;
         token.value = this->peek();
 
@@ -171,23 +151,48 @@ public:
         int base = this->eat("0x") ? 16 : 10;
 
         if( auto&& [b, s] = this->eat_digits(base); b ) {
-          token.value = std::stoull(s, nullptr, base);
+          if( std::from_chars(s.data(), s.data() + s.size(), token.value, base).ec != std::errc{ } )
+            Err("value '" + s + "' is out of range, " + this->where());
+
           token.s = "#" + s;
         }
         else
           Err("expected digits after '#'");
       }
 
-      // identigier
+      // identigier, register (rN, vN, alias)
       else if( this->peek() == '_' || isalnum(this->peek()) ) {
         token.kind = Token::Kind::Ident;
         token.s = this->eat_ident();
+
+        auto& s = token.s;
+
+        if( s.length() >= 2 && (s[0] == 'r' || s[0] == 'v')
+            && std::all_of(s.begin() + 1, s.end(), [] (char c) { return isdigit(c); }) ) {
+          int r = 0;
+
+          if( std::from_chars(s.data() + 1, s.data() + s.size(), r).ec != std::errc{ } || r >= 16 ) {
+            Err("invalid register index '" + s + "', " + this->where());
+          }
+
+          token.kind = s[0] == 'r' ? Token::Kind::Register : Token::Kind::VRegister;
+          token.reg_index = r & 0xFF;
+        }
+        else {
+          for( auto&& [x, y] : register_aliases ) {
+            if( s == x ) {
+              token.kind = Token::Kind::Register;
+              token.reg_index = y;
+              break;
+            }
+          }
+        }
       }
 
       // string
       else if( this->eat("\"") ) {
         token.kind = Token::Kind::String;
-        auto pos = ++this->position;
+        auto pos = this->position;
 
         while( this->check() && !this->eat("\"") )
           this->position++;
@@ -258,10 +263,18 @@ public:
 
   std::vector<std::vector<Token>::iterator> matched;
 
-  std::map<std::string, size_t> labels;
+  Object obj;
+
+  std::unordered_map<std::string, size_t> labels;  // name => index of obj.symbols
+
+  // labels waiting for the next data directive
+  std::vector<std::string> data_labels;
 
-  Assembler(std::string const& path)
-    : source(open_text_file(path)),
+  // names given by .global
+  std::vector<std::string> globals;
+
+  Assembler(std::string const& source)
+    : source(source),
       tokens(Lexer(this->source).lex()),
       iter(tokens.begin())
   {
@@ -276,6 +289,9 @@ public:
     for( auto&& p : patterns ) {
       this->matched.emplace_back(it);
 
+      if( it == this->tokens.end() )
+        return false;
+
       if( p.type == Pattern::Type::TokenKind && it++->kind != p.k )
         return false;
       else if( p.type == Pattern::Type::String && it++->s != p.s )
@@ -300,7 +316,46 @@ public:
       Err("expected '" + s + "'");
   }
 
-  std::vector<Asm> assemb() {
+  void add_symbol(std::string const& name, Object::Section section, u64 offset) {
+    if( this->labels.contains(name) )
+      Err("duplicate label '" + name + "'");
+
+    this->labels[name] = this->obj.symbols.size();
+    this->obj.symbols.push_back({ name, section, offset, false });
+  }
+
+  void add_reloc(Object::Section section, std::string const& name) {
+    this->obj.relocs.push_back({ this->obj.codes.size() - 1, section, name });
+  }
+
+  static size_t data_align(Asm::DataType type) {
+    if( type == Asm::DataType::String )
+      return sizeof(char16_t);
+
+    return 1ul << static_cast<int>(type);
+  }
+
+  /*
+   * place a data in the segment with natural alignment.
+   * pending labels are bound to the aligned offset.
+   */
+  size_t place_data(Asm::DataType type, void const* ptr, size_t size) {
+    size_t align = data_align(type);
+    auto& data = this->obj.data;
+    size_t offs = (data.size() + align - 1) & ~(align - 1);
+
+    data.resize(offs + size);
+    memcpy(data.data() + offs, ptr, size);
+
+    for( auto&& name : this->data_labels )
+      this->add_symbol(name, Object::Section::Data, offs);
+
+    this->data_labels.clear();
+
+    return offs;
+  }
+
+  Object assemb() {
     using Tk = Token::Kind;
 
     static constexpr char const* instructions[] = {
@@ -313,8 +368,10 @@ public:
       "mod",
       "lst",
       "rst",
+      "and",
       "ldr",
       "str",
+      "adr",
       "push",
       "pop",
       "call",
@@ -330,14 +387,74 @@ public:
       return std::nullopt;
     };
 
-    std::vector<Asm> ret;
+    static constexpr std::pair<std::string_view, Asm::Kind> vector_instructions[] = {
+      { "vld",  Asm::Kind::VLoad },
+      { "vst",  Asm::Kind::VStore },
+      { "vdup", Asm::Kind::VDup },
+      { "vadd", Asm::Kind::VAdd },
+      { "vsub", Asm::Kind::VSub },
+      { "vmul", Asm::Kind::VMul },
+      { "vand", Asm::Kind::VAnd },
+      { "vceq", Asm::Kind::VCmpEq },
+      { "vcgt", Asm::Kind::VCmpGt },
+      { "vsum", Asm::Kind::VSum },
+      { "vmax", Asm::Kind::VMax },
+    };
+
+    static constexpr auto get_atomic_inst = [] (std::string_view name) -> std::optional<Asm::Kind> {
+      if( name == "cas" ) return Asm::Kind::Cas;
+      if( name == "xadd" ) return Asm::Kind::Xadd;
+      if( name == "xchg" ) return Asm::Kind::Xchg;
+
+      return std::nullopt;
+    };
+
+    // vadd{b,h,w,u} => ( VAdd, lane type )
+    static constexpr auto get_vector_inst = [] (std::string_view name)
+        -> std::optional<std::pair<Asm::Kind, Asm::DataType>> {
+      for( auto&& [s, k] : vector_instructions ) {
+        if( !name.starts_with(s) )
+          continue;
+
+        if( name.length() == s.length() )
+          return std::make_pair(k, Asm::DataType::Long);
+
+        // vld, vst have no lane type
+        if( name.length() != s.length() + 1 || k == Asm::Kind::VLoad || k == Asm::Kind::VStore )
+          continue;
+
+        switch( name.back() ) {
+          case 'u': return std::make_pair(k, Asm::DataType::Long);
+          case 'w': return std::make_pair(k, Asm::DataType::Word);
+          case 'h': return std::make_pair(k, Asm::DataType::Harf);
+          case 'b': return std::make_pair(k, Asm::DataType::Byte);
+        }
+      }
+
+      return std::nullopt;
+    };
+
+    auto& ret = this->obj.codes;
     auto& M = this->matched;
 
     while( this->iter != tokens.end() ) {
 
       // label
       if( this->match({Tk::Ident, ":"}) ) {
-        ret.emplace_back(Asm::Kind::Label).str = M[0]->s;
+        // a label of data
+        if( this->iter != tokens.end() && this->iter->s == "."
+            && this->iter + 1 != tokens.end() && (this->iter + 1)->s != "global" ) {
+          this->data_labels.emplace_back(M[0]->s);
+        }
+        else {
+          ret.emplace_back(Asm::Kind::Label).str = M[0]->s;
+          this->add_symbol(M[0]->s, Object::Section::Code, ret.size());
+        }
+      }
+
+      // export
+      else if( this->match({".", "global", Tk::Ident}) ) {
+        this->globals.emplace_back(M[2]->s);
       }
 
       // data
@@ -350,58 +467,65 @@ public:
           "string",
         };
 
-        auto& op = ret.emplace_back(Asm::Kind::Data, 0, 0, 0);
+        auto type = Asm::DataType::Long;
+
+        for( size_t i = 0; i <= std::size(dtypes); i++ ) {
+          if( i == std::size(dtypes) )
+            Err("unknown data type '" + M[1]->s + "'");
 
-        for( size_t i = 0; i < std::size(dtypes); i++ ) {
           if( M[1]->s == dtypes[i] ) {
-            op.data_type = static_cast<Asm::DataType>(i);
-            goto _found;
+            type = static_cast<Asm::DataType>(i);
+            break;
           }
         }
 
-        if( op.data_type == Asm::DataType::String ) {
-          std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> conv;
+        if( type == Asm::DataType::String ) {
+          std::u16string str;
 
-          if( this->iter->kind != Tk::String ) {
+          if( this->iter == tokens.end() || this->iter->kind != Tk::String ) {
             Err("expected string literal");
           }
 
-          auto str = conv.from_bytes(this->iter++->s);
+          if( !utf::utf8_to_utf16(str, this->iter++->s) )
+            Err("invalid UTF-8 in string literal");
 
-          auto data = new char16_t[str.length() + 1];
-
-          memcpy(data, str.data(), str.size());
-
-          op.data = (void*)data;
+          // with terminator
+          this->place_data(type, str.c_str(), (str.length() + 1) * sizeof(char16_t));
         }
-        else {
-          if( this->iter->kind != Tk::Value ) {
-            Err("expected digits");
-          }
-
-          op.value = this->iter++->value;
 
-          // check data size
-          if( op.data_type == Asm::DataType::Byte && op.value <= 0xFF );
-          else if( op.data_type == Asm::DataType::Harf && op.value <= 0xFFFF );
-          else if( op.data_type == Asm::DataType::Word && op.value <= 0xFFFFFFFF );
-          else if( op.data_type == Asm::DataType::Long && op.value <= 0xFFFFFFFFFFFFFFFF );
-          else
-            Err("overflow");
+        // .type #value, #value, ...
+        else {
+          do {
+            if( this->iter == tokens.end() || this->iter->kind != Tk::Value ) {
+              Err("expected digits");
+            }
+
+            u64 value = this->iter++->value;
+
+            // check data size
+            if( type == Asm::DataType::Byte && value <= 0xFF );
+            else if( type == Asm::DataType::Harf && value <= 0xFFFF );
+            else if( type == Asm::DataType::Word && value <= 0xFFFFFFFF );
+            else if( type == Asm::DataType::Long );
+            else
+              Err("overflow");
+
+            // little endian host
+            this->place_data(type, &value, data_align(type));
+          } while( this->iter != tokens.end() && this->eat(",") );
         }
-
-        Err("unknown data type '" + M[1]->s + "'");
-      _found:;
       }
 
       // call
       else if( this->match({"call", Tk::Ident}) ) {
         ret.emplace_back(Asm::Kind::Call).str = M[1]->s;
+        this->add_reloc(Object::Section::Code, M[1]->s);
       }
 
       // jmp
       else if( this->match({"jmp", Tk::Ident}) ) {
         ret.emplace_back(Asm::Kind::Jump).str = M[1]->s;
+        this->add_reloc(Object::Section::Code, M[1]->s);
       }
 
       // jx
@@ -409,18 +533,59 @@ public:
         ret.emplace_back(Asm::Kind::Jumpx).ra = M[1]->reg_index;
       }
 
+      // ret
+      else if( this->match({"ret"}) ) {
+        ret.emplace_back(Asm::Kind::Ret);
+      }
+
+      // mov rd, <code label>
+      else if( this->match({"mov", Tk::Register, ",", Tk::Ident}) ) {
+        auto& op = ret.emplace_back(Asm::Kind::Mov, M[1]->reg_index, 0, 0);
+
+        op.with_value = true;
+        op.str = M[3]->s;
+        this->add_reloc(Object::Section::Code, M[3]->s);
+      }
+
+      // fence
+      else if( this->match({"fence"}) ) {
+        ret.emplace_back(Asm::Kind::Fence);
+      }
+
+
+      // adr
+      else if( this->match({"adr", Tk::Register, ",", Tk::Ident}) ) {
+        ret.emplace_back(Asm::Kind::Adr, M[1]->reg_index, 0, 0);
+        this->add_reloc(Object::Section::Data, M[3]->s);
+      }
+
       // syscall
       else if( this->match({"sys", Tk::Value}) ) {
+        if( M[1]->value >= vm::SysCallTable::MaxSysCalls )
+          Err("system call number too large");
+
         ret.emplace_back(Asm::Kind::SysCall).value = M[1]->value;
       }
 
+      // syscall by name ( of the host: resolved when executed )
+      else if( this->match({"sys", Tk::Ident}) ) {
+        auto& op = ret.emplace_back(Asm::Kind::SysCall);
+
+        if( auto n = vm::SysCallTable::global()->find(M[1]->s) )
+          op.value = *n;
+        else {
+          op.value = vm::SysCallTable::ByName;
+          op.str = M[1]->s;
+        }
+      }
+
       /*
        * op rd, ra
        *    rd, #value
        *    rd, ra, rb
        *    rd, ra, #value
        */
-      else if( auto k = get_inst_kind(this->iter->s); k && k.value() <= Asm::Kind::Rst ) {
+      else if( auto k = get_inst_kind(this->iter->s); k && k.value() <= Asm::Kind::And ) {
         this->iter++;
 
         // rd
@@ -456,9 +621,80 @@ public:
           goto __err;
       }
 
+      // atomic  rd, ra, [rb]
+      else if( this->iter->kind == Tk::Ident && get_atomic_inst(this->iter->s) ) {
+        auto kind = *get_atomic_inst(this->iter++->s);
+
+        if( !this->match({Tk::Register, ",", Tk::Register, ",", "[", Tk::Register, "]"}) )
+          goto __err;
+
+        ret.emplace_back(kind, M[0]->reg_index, M[2]->reg_index, M[5]->reg_index);
+      }
+
+      // vector
+      else if( this->iter->kind == Tk::Ident && get_vector_inst(this->iter->s) ) {
+        auto [kind, lane] = *get_vector_inst(this->iter->s);
+        auto& op = ret.emplace_back(kind, 0, 0, 0);
+
+        op.data_type = lane;
+        this->iter++;
+
+        switch( op.kind ) {
+          // vA, [rAddr, #offs], #N
+          case Asm::Kind::VLoad:
+          case Asm::Kind::VStore:
+            if( !this->match({Tk::VRegister, ",", "[", Tk::Register}) )
+              goto __err;
+
+            op.ra = M[0]->reg_index;
+            op.rb = M[3]->reg_index;
+
+            if( this->match({",", Tk::Value}) )
+              op.value = M[1]->value;
+
+            if( this->iter == tokens.end() || this->iter++->s != "]" )
+              goto __err;
+
+            if( this->match({",", Tk::Value}) )
+              op.rd = M[1]->value & 0xFF;
+
+            break;
+
+          // vDest, rA
+          case Asm::Kind::VDup:
+            if( !this->match({Tk::VRegister, ",", Tk::Register}) )
+              goto __err;
+
+            op.rd = M[0]->reg_index;
+            op.ra = M[2]->reg_index;
+            break;
+
+          // rDest, vA
+          case Asm::Kind::VSum:
+          case Asm::Kind::VMax:
+            if( !this->match({Tk::Register, ",", Tk::VRegister}) )
+              goto __err;
+
+            op.rd = M[0]->reg_index;
+            op.ra = M[2]->reg_index;
+            break;
+
+          // vDest, vA, vB
+          default:
+            if( !this->match({Tk::VRegister, ",", Tk::VRegister, ",", Tk::VRegister}) )
+              goto __err;
+
+            op.rd = M[0]->reg_index;
+            op.ra = M[2]->reg_index;
+            op.rb = M[4]->reg_index;
+            break;
+        }
+      }
+
       // load or store
       else if( this->iter->s.length() >= 3 && (this->iter->s.starts_with("ldr") || this->iter->s.starts_with("str")) ) {
-        auto& op = ret.emplace_back();
+        Asm op;
+        bool via_label = false;
 
         op.kind = this->iter->s.starts_with("ldr") ? Asm::Kind::Load : Asm::Kind::Store;
 
@@ -477,11 +713,21 @@ public:
           op.data_type = Asm::DataType::Long;
         }
 
-        if( !this->match({Tk::Ident, Tk::Register, ",", "[", Tk::Register}) )
-          goto __err;
+        // [<label>, #offs]  =>  adr ip, <label>
+        if( this->match({Tk::Ident, Tk::Register, ",", "[", Tk::Ident}) ) {
+          op.ra = M[1]->reg_index;
+          op.rb = 12; // ip
+          via_label = true;
 
-        op.ra = M[1]->reg_index;
-        op.rb = M[4]->reg_index;
+          ret.emplace_back(Asm::Kind::Adr, op.rb, 0, 0);
+          this->add_reloc(Object::Section::Data, M[4]->s);
+        }
+        else if( this->match({Tk::Ident, Tk::Register, ",", "[", Tk::Register}) ) {
+          op.ra = M[1]->reg_index;
+          op.rb = M[4]->reg_index;
+        }
+        else
+          goto __err;
 
         // offset
         if( this->match({",", Tk::Value}) ) {
@@ -492,8 +738,13 @@ public:
           goto __err;
 
         if( this->match({",", Tk::Value}) ) {
+          if( via_label )
+            Err("cannot write-back to a label");
+
           op.rd = M[1]->value & 0xFF;
         }
+
+        ret.emplace_back(op);
       }
 
       // push / pop
@@ -532,12 +783,69 @@ public:
       }
     }
 
-    return ret;
+    if( !this->data_labels.empty() )
+      Err("label '" + this->data_labels[0] + "' has no data");
+
+    for( auto&& name : this->globals ) {
+      if( auto it = this->labels.find(name); it != this->labels.end() )
+        this->obj.symbols[it->second].global = true;
+      else
+        Err("undefined label '" + name + "' in .global");
+    }
+
+    this->obj.source_hash = hash_source(this->source);
+
+    return std::move(this->obj);
   }
 };
 
-std::vector<Asm> assemble_from_file(std::string const& path) {
-  return Assembler(path).assemb();
+// FNV-1a
+u64 hash_source(std::string_view source) {
+  u64 h = 0xcbf29ce484222325;
+
+  for( char c : source ) {
+    h ^= (u8)c;
+    h *= 0x100000001b3;
+  }
+
+  return h;
+}
+
+// timed for metrics::VM::assemble_latency
+static Object assemble_source(std::string const& source) {
+  auto begin = std::chrono::steady_clock::now();
+  auto obj = Assembler(source).assemb();
+
+  metrics::vm().assemble_latency.observe(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - begin).count());
+
+  return obj;
+}
+
+Object assemble_object(std::string const& path) {
+  return assemble_source(open_text_file(path));
+}
+
+Object assemble_cached(std::string const& path, std::string const& obj_path) {
+  auto source = open_text_file(path);
+  Object obj;
+
+  if( read_object(obj, obj_path) && obj.source_hash == hash_source(source) ) {
+    metrics::vm().object_cache_hits.add();
+    return obj;
+  }
+
+  metrics::vm().object_cache_misses.add();
+  obj = assemble_source(source);
+
+  if( !write_object(obj_path, obj) )
+    std::cout << "metro.assembler: cannot write '" << obj_path << "'" << std::endl;
+
+  return obj;
+}
+
+Image assemble_from_file(std::string const& path) {
+  return linker::link({ assemble_object(path) });
 }
 
 bool assemble_full(std::vector<u8>& out, std::vector<vm::Asm> const& codes) {
@@ -0,0 +1,131 @@
+#include "metro.h"
+#include "metro_c.h"
+
+using namespace metro::vm;
+
+struct metro_program {
+  std::shared_ptr<Program const> prog;
+};
+
+// metro_machine is Machine itself
+static Machine* M(metro_machine* m) {
+  return reinterpret_cast<Machine*>(m);
+}
+
+static Machine const* M(metro_machine const* m) {
+  return reinterpret_cast<Machine const*>(m);
+}
+
+static Machine::Budget make_budget(uint64_t fuel, uint64_t timeout_us) {
+  Machine::Budget budget;
+
+  if( fuel )
+    budget.fuel = fuel;
+
+  if( timeout_us )
+    budget.deadline = Machine::Clock::now() + std::chrono::microseconds(timeout_us);
+
+  return budget;
+}
+
+static int to_status(Machine::RunStatus st) {
+  switch( st ) {
+    case Machine::RunStatus::OutOfFuel: return METRO_OUT_OF_FUEL;
+    case Machine::RunStatus::Deadline:  return METRO_DEADLINE;
+    case Machine::RunStatus::Fault:     return METRO_FAULT;
+    default:                            return METRO_HALTED;
+  }
+}
+
+extern "C" {
+
+metro_program* metro_program_load(char const* const* paths, size_t count, int optimize) {
+  auto prog = Program::from_files({ paths, paths + count }, optimize);
+
+  return prog ? new metro_program{ std::move(prog) } : nullptr;
+}
+
+void metro_program_free(metro_program* prog) {
+  delete prog;
+}
+
+int64_t metro_program_entry(metro_program const* prog, char const* name) {
+  auto e = prog->prog->entry(name);
+
+  return e ? (int64_t)*e : -1;
+}
+
+metro_machine* metro_machine_new(metro_program const* prog, int guest) {
+  auto m = new Machine(guest ? Machine::MemoryMode::Guest : Machine::MemoryMode::Host);
+
+  m->load(prog->prog);
+  return reinterpret_cast<metro_machine*>(m);
+}
+
+void metro_machine_free(metro_machine* m) {
+  delete M(m);
+}
+
+int metro_machine_start(metro_machine* m, uint64_t entry, uint64_t fuel, uint64_t timeout_us) {
+  M(m)->start(entry);
+
+  return to_status(M(m)->run(make_budget(fuel, timeout_us)));
+}
+
+int metro_machine_resume(metro_machine* m, uint64_t fuel, uint64_t timeout_us) {
+  return to_status(M(m)->run(make_budget(fuel, timeout_us)));
+}
+
+char const* metro_machine_fault(metro_machine const* m) {
+  return M(m)->last_fault.c_str();
+}
+
+int metro_machine_reload(metro_machine* m, metro_program const* prog) {
+  return M(m)->reload(prog->prog) ? 0 : -1;
+}
+
+int metro_machine_get_reg(metro_machine const* m, int index, uint64_t* value) {
+  if( index < 0 || index >= 16 )
+    return -1;
+
+  *value = M(m)->cpu.registers[index];
+  return 0;
+}
+
+int metro_machine_set_reg(metro_machine* m, int index, uint64_t value) {
+  if( index < 0 || index >= 16 )
+    return -1;
+
+  M(m)->cpu.registers[index] = value;
+  return 0;
+}
+
+// memory_base is the host address of the memory in Host mode
+void* metro_machine_ptr(metro_machine* m, uint64_t addr, size_t size) {
+  auto mp = M(m);
+
+  if( size > mp->memory_size || addr - mp->memory_base > mp->memory_size - size )
+    return nullptr;
+
+  return mp->host_ptr(addr, size);
+}
+
+int metro_machine_on_syscall(metro_machine* m, uint64_t number, char const* name,
+    metro_syscall_fn fn, void* user) {
+  if( number < Machine::HostSysCallBase || number >= SysCallTable::MaxSysCalls )
+    return -1;
+
+  if( !name )
+    name = "";
+
+  if( auto n = M(m)->root->syscalls->find(name); *name && n && *n != number )
+    return -1;
+
+  M(m)->on_syscall(number, name, [fn, user] (Machine& mm) {
+    fn(reinterpret_cast<metro_machine*>(&mm), user);
+  });
+
+  return 0;
+}
+
+} // extern "C"
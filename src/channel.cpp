@@ -0,0 +1,186 @@
+#include <atomic>
+#include <bit>
+#include "metro.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+  #define METRO_CHANNEL_X86 1
+#else
+  #define METRO_CHANNEL_X86 0
+#endif
+
+namespace metro::vm {
+
+namespace {
+
+using atomic_u64 = std::atomic_ref<u64>;
+
+void cpu_relax() {
+#if METRO_CHANNEL_X86
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#else
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// spin a while, then give the core to others
+void backoff(u32& n) {
+  if( ++n < 64 )
+    cpu_relax();
+  else
+    std::this_thread::yield();
+}
+
+} // namespace
+
+Channel::Channel(Kind kind, size_t capacity, size_t message_size)
+  : _kind(kind),
+    mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1),
+    msg_size(message_size)
+{
+  this->stride = (message_size + sizeof(u64) - 1) & ~(sizeof(u64) - 1);
+
+  if( kind == Kind::MPMC )
+    this->stride += sizeof(u64);
+
+  this->buffer = std::make_unique<u8[]>(this->stride * (this->mask + 1));
+
+  // slot i is free for the sender of position i
+  if( kind == Kind::MPMC ) {
+    for( u64 i = 0; i <= this->mask; i++ )
+      *(u64*)this->slot(i) = i;
+  }
+}
+
+bool Channel::try_send(void const* msg) {
+  if( this->_kind == Kind::SPSC ) {
+    u64 t = atomic_u64(this->tail).load(std::memory_order_relaxed);
+
+    if( t - this->head_cache > this->mask ) {
+      this->head_cache = atomic_u64(this->head).load(std::memory_order_acquire);
+
+      if( t - this->head_cache > this->mask )
+        return false;
+    }
+
+    memcpy(this->slot(t), msg, this->msg_size);
+    atomic_u64(this->tail).store(t + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  u64 pos = atomic_u64(this->tail).load(std::memory_order_relaxed);
+  u8* p;
+
+  while( true ) {
+    p = this->slot(pos);
+
+    i64 diff = (i64)(atomic_u64(*(u64*)p).load(std::memory_order_acquire) - pos);
+
+    if( diff == 0 ) {
+      if( atomic_u64(this->tail).compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+        break;
+    }
+    else if( diff < 0 )
+      return false;   // full
+    else
+      pos = atomic_u64(this->tail).load(std::memory_order_relaxed);
+  }
+
+  memcpy(p + sizeof(u64), msg, this->msg_size);
+  atomic_u64(*(u64*)p).store(pos + 1, std::memory_order_release);
+
+  return true;
+}
+
+bool Channel::try_recv(void* msg) {
+  if( this->_kind == Kind::SPSC ) {
+    u64 h = atomic_u64(this->head).load(std::memory_order_relaxed);
+
+    if( h == this->tail_cache ) {
+      this->tail_cache = atomic_u64(this->tail).load(std::memory_order_acquire);
+
+      if( h == this->tail_cache )
+        return false;
+    }
+
+    memcpy(msg, this->slot(h), this->msg_size);
+    atomic_u64(this->head).store(h + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  u64 pos = atomic_u64(this->head).load(std::memory_order_relaxed);
+  u8* p;
+
+  while( true ) {
+    p = this->slot(pos);
+
+    i64 diff = (i64)(atomic_u64(*(u64*)p).load(std::memory_order_acquire) - (pos + 1));
+
+    if( diff == 0 ) {
+      if( atomic_u64(this->head).compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+        break;
+    }
+    else if( diff < 0 )
+      return false;   // empty
+    else
+      pos = atomic_u64(this->head).load(std::memory_order_relaxed);
+  }
+
+  memcpy(msg, p + sizeof(u64), this->msg_size);
+
+  // free for the sender of one lap later
+  atomic_u64(*(u64*)p).store(pos + this->mask + 1, std::memory_order_release);
+
+  return true;
+}
+
+void Channel::send(void const* msg) {
+  for( u32 n = 0; !this->try_send(msg); )
+    backoff(n);
+}
+
+void Channel::recv(void* msg) {
+  for( u32 n = 0; !this->try_recv(msg); )
+    backoff(n);
+}
+
+bool Channel::send_for(void const* msg, u32 rounds) {
+  for( u32 n = 0; !this->try_send(msg); backoff(n) ) {
+    if( n == rounds )
+      return false;
+  }
+
+  return true;
+}
+
+bool Channel::recv_for(void* msg, u32 rounds) {
+  for( u32 n = 0; !this->try_recv(msg); backoff(n) ) {
+    if( n == rounds )
+      return false;
+  }
+
+  return true;
+}
+
+//
+// Machine
+//
+
+u64 Machine::attach(std::shared_ptr<Channel> ch) {
+  this->root->channels.emplace_back(std::move(ch));
+
+  return this->root->channels.size() - 1;
+}
+
+Channel& Machine::channel(u64 index) {
+  if( index >= this->root->channels.size() )
+    this->fault("no channel " + std::to_string(index));
+
+  return *this->root->channels[index];
+}
+
+} // namespace metro::vm
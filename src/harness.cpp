@@ -0,0 +1,430 @@
+#include <chrono>
+#include <random>
+#include <sstream>
+#include "metro.h"
+
+namespace metro::harness {
+
+using namespace metro::vm;
+using Kind = Asm::Kind;
+
+namespace {
+
+constexpr size_t DataSize = 256;
+constexpr size_t StackCompare = 64 * sizeof(u64);
+constexpr size_t ProgramLength = 200;
+constexpr size_t Repeats = 5;     // timing is the best of these
+
+constexpr u8 Base = 12;           // ip = address of data, not compared
+constexpr u8 Registers = 12;      // r0 .. r11 are compared
+
+struct Engine {
+  std::string           name;
+  Machine::MemoryMode   mode;
+  bool                  optimize;
+  simd::Kernels const*  kernels;    // nullptr = best for host
+  bool                  metered = false;        // run with a budget
+  bool                  instrumented = false;   // with a MemoryProfile
+};
+
+// result of a run, addresses made relative
+struct State {
+  u64   registers[Registers];
+  u64   sp;                         // offset from the stack
+  VReg  vregs[16];
+
+  std::vector<u8> data;
+  std::vector<u8> stack;
+};
+
+/*
+ * random valid programs
+ *
+ *   adr ip, data  /  random values to r0 .. r11
+ *   ALU ( div / mod by non-zero immediate only )
+ *   ldr / str in the data, push / pop balanced
+ *   vector operations in the data
+ *   forward jmp over a few operations
+ */
+class Generator {
+  std::mt19937_64 rng;
+
+  u64 next(u64 n) {
+    return this->rng() % n;
+  }
+
+  u8 reg() {
+    return this->next(Registers);
+  }
+
+  u64 imm() {
+    static constexpr u64 edges[] = {
+      0, 1, 2, 3, 7, 10, 63, 64, 255, 0x8000'0000, ~(u64)0, (u64)1 << 63,
+    };
+
+    switch( this->next(3) ) {
+      case 0: return edges[this->next(std::size(edges))];
+      case 1: return this->next(1000);
+      default: return this->rng();
+    }
+  }
+
+  Asm::DataType type() {
+    return static_cast<Asm::DataType>(this->next(4));
+  }
+
+public:
+  explicit Generator(u64 seed)
+    : rng(seed)
+  {
+  }
+
+  Image make() {
+    Image img;
+
+    img.data.resize(DataSize);
+
+    for( auto&& b : img.data )
+      b = this->rng();
+
+    auto& c = img.codes;
+
+    c.emplace_back(Kind::Adr, Base, 0, 0);
+
+    for( u8 r = 0; r < Registers; r++ )
+      c.emplace_back(Kind::Mov, r, 0, 0, this->imm());
+
+    std::vector<size_t> pushed;                         // count of each push
+    std::vector<std::pair<size_t, size_t>> jumps;       // index of jmp, ops to skip
+
+    for( size_t n = 0; n < ProgramLength; n++ ) {
+      u64 x = this->next(100);
+
+      // ALU
+      if( x < 45 ) {
+        static constexpr Kind kinds[] = {
+          Kind::Mov, Kind::Add, Kind::Sub, Kind::Mul, Kind::Div,
+          Kind::Mod, Kind::Lst, Kind::Rst, Kind::And,
+        };
+
+        Kind k = kinds[this->next(std::size(kinds))];
+
+        if( k == Kind::Div || k == Kind::Mod || this->next(2) ) {
+          u64 v = this->imm();
+
+          c.emplace_back(k, this->reg(), this->reg(), 0, v ? v : 1);
+        }
+        else
+          c.emplace_back(k, this->reg(), this->reg(), this->reg());
+      }
+
+      // load / store
+      else if( x < 65 ) {
+        auto t = this->type();
+        size_t width = (size_t)1 << (int)t;
+        auto& op = c.emplace_back(this->next(2) ? Kind::Load : Kind::Store, 0, this->reg(), Base);
+
+        op.data_type = t;
+        op.value = this->next(DataSize / width) * width;
+      }
+
+      // push / pop ( not while a jump may skip one )
+      else if( x < 73 ) {
+        if( !jumps.empty() )
+          continue;
+
+        if( !pushed.empty() && this->next(2) ) {
+          u32 mask = 0;
+
+          while( (size_t)__builtin_popcount(mask) < pushed.back() )
+            mask |= 1 << this->reg();
+
+          c.emplace_back(Kind::Pop).reglist = mask;
+          pushed.pop_back();
+        }
+        else if( pushed.size() < 8 ) {
+          u32 mask = 0;
+
+          for( size_t i = this->next(4) + 1; i--; )
+            mask |= 1 << this->reg();
+
+          c.emplace_back(Kind::Push).reglist = mask;
+          pushed.push_back(__builtin_popcount(mask));
+        }
+      }
+
+      // vector
+      else if( x < 93 ) {
+        static constexpr Kind kinds[] = {
+          Kind::VLoad, Kind::VStore, Kind::VDup, Kind::VAdd, Kind::VSub, Kind::VMul,
+          Kind::VAnd, Kind::VCmpEq, Kind::VCmpGt, Kind::VSum, Kind::VMax,
+        };
+
+        Kind k = kinds[this->next(std::size(kinds))];
+        auto& op = c.emplace_back(k, this->next(16), this->next(16), this->next(16));
+
+        op.data_type = this->type();
+
+        switch( k ) {
+          case Kind::VLoad:
+          case Kind::VStore:
+            op.rd = 0;
+            op.rb = Base;
+            op.value = this->next(DataSize - sizeof(VReg) + 1);
+            break;
+
+          case Kind::VDup:
+            op.ra = this->reg();
+            break;
+
+          case Kind::VSum:
+          case Kind::VMax:
+            op.rd = this->reg();
+            break;
+        }
+      }
+
+      // forward jump
+      else if( jumps.size() < 4 ) {
+        jumps.emplace_back(c.size(), this->next(5) + 1);
+        c.emplace_back(Kind::Jump);
+      }
+
+      // labels of jumps done skipping
+      for( size_t i = 0; i < jumps.size(); ) {
+        if( jumps[i].first + 1 < c.size() && --jumps[i].second == 0 ) {
+          c[jumps[i].first].value = c.size();
+          c.emplace_back(Kind::Label);
+          jumps.erase(jumps.begin() + i);
+        }
+        else
+          i++;
+      }
+    }
+
+    for( auto&& [at, _] : jumps ) {
+      c[at].value = c.size();
+      c.emplace_back(Kind::Label);
+    }
+
+    return img;
+  }
+};
+
+class Runner {
+  std::vector<Engine> engines;
+  std::vector<std::unique_ptr<Machine>> machines;
+
+public:
+  std::vector<double> best_ns;     // sum of the best time of each program
+
+  Runner() {
+    this->engines.push_back({ "interp", Machine::MemoryMode::Host, false, nullptr });
+    this->engines.push_back({ "guest", Machine::MemoryMode::Guest, false, nullptr });
+    this->engines.push_back({ "optimized", Machine::MemoryMode::Host, true, nullptr });
+
+    // the other instantiations of run_with
+    for( auto mode : { Machine::MemoryMode::Host, Machine::MemoryMode::Guest } ) {
+      std::string prefix = mode == Machine::MemoryMode::Guest ? "guest-" : "";
+
+      this->engines.push_back({ prefix + "metered", mode, false, nullptr, true, false });
+      this->engines.push_back({ prefix + "profiled", mode, false, nullptr, false, true });
+      this->engines.push_back({ prefix + "profiled-metered", mode, false, nullptr, true, true });
+    }
+
+    for( auto b : { simd::Backend::Scalar, simd::Backend::SSE2, simd::Backend::AVX2 } ) {
+      if( auto k = simd::kernels(b) )
+        this->engines.push_back({ std::string("simd-") + simd::backend_name(b),
+          Machine::MemoryMode::Host, false, k });
+    }
+
+    for( auto&& e : this->engines )
+      this->machines.emplace_back(std::make_unique<Machine>(e.mode));
+
+    this->best_ns.resize(this->engines.size());
+  }
+
+  std::vector<Engine> const& all() const {
+    return this->engines;
+  }
+
+  State run(size_t index, Image const& image, bool timed) {
+    auto& e = this->engines[index];
+    auto& m = *this->machines[index];
+    Image img = image;
+
+    if( e.optimize )
+      optimizer::default_pipeline().run(img);
+
+    double best = 0;
+
+    // fuel is never the limit, generated programs only jump forward
+    Machine::Budget budget;
+
+    if( e.metered )
+      budget.fuel = (u64)1 << 40;
+
+    for( size_t i = 0; i < (timed ? Repeats : 1); i++ ) {
+      MemoryProfile profile;
+
+      m.load(img);
+      m.kernels = e.kernels;
+      m.cpu = VCPU{ };
+      m.set_profile(e.instrumented ? &profile : nullptr);
+
+      auto begin = std::chrono::steady_clock::now();
+
+      m.start();
+      m.run(img.codes, budget);
+
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+
+      m.set_profile(nullptr);
+
+      if( i == 0 || ns < best )
+        best = ns;
+    }
+
+    if( timed )
+      this->best_ns[index] += best;
+
+    State st;
+
+    memcpy(st.registers, m.cpu.registers, sizeof(st.registers));
+    memcpy(st.vregs, m.cpu.vregs, sizeof(st.vregs));
+
+    st.sp = m.cpu.registers[13] - m.guest_addr((u8*)m.stack);
+    st.data.assign(m.data, m.data + m.data_size);
+    st.stack.assign((u8*)m.stack, (u8*)m.stack + StackCompare);
+
+    return st;
+  }
+
+  // first difference of an engine from engine 0, or empty
+  std::string diverges(Image const& img, bool timed) {
+    std::vector<State> states;
+
+    for( size_t i = 0; i < this->engines.size(); i++ )
+      states.push_back(this->run(i, img, timed));
+
+    auto& ref = states[0];
+
+    for( size_t i = 1; i < states.size(); i++ ) {
+      auto& st = states[i];
+      std::ostringstream ss;
+
+      for( u8 r = 0; r < Registers; r++ ) {
+        if( st.registers[r] != ref.registers[r] ) {
+          ss << "r" << (int)r << " = " << std::hex << st.registers[r] << ", expected " << ref.registers[r];
+          break;
+        }
+      }
+
+      if( ss.str().empty() ) {
+        if( st.sp != ref.sp )
+          ss << "sp offset = " << st.sp << ", expected " << ref.sp;
+        else if( memcmp(st.vregs, ref.vregs, sizeof(st.vregs)) )
+          ss << "vector registers";
+        else if( st.data != ref.data )
+          ss << "data memory";
+        else if( st.stack != ref.stack )
+          ss << "stack memory";
+      }
+
+      if( !ss.str().empty() )
+        return this->engines[i].name + ": " + ss.str();
+    }
+
+    return { };
+  }
+};
+
+// remove operations while it still diverges
+Image minimize(Runner& runner, Image img) {
+  for( bool changed = true; changed; ) {
+    changed = false;
+
+    for( size_t i = 0; i < img.codes.size(); i++ ) {
+      switch( img.codes[i].kind ) {
+        case Kind::Adr:
+        case Kind::Push:
+        case Kind::Pop:
+        case Kind::Jump:
+        case Kind::Label:
+        case Kind::Nop:
+          continue;
+      }
+
+      Image tmp = img;
+
+      tmp.codes[i] = Asm(Kind::Nop);
+
+      if( !runner.diverges(tmp, false).empty() ) {
+        img = std::move(tmp);
+        changed = true;
+      }
+    }
+  }
+
+  return img;
+}
+
+void dump(Image const& img) {
+  static char const* const names[] = {
+    "mov", "cmp", "add", "sub", "mul", "div", "mod", "lst", "rst", "and",
+    "ldr", "str", "adr", "push", "pop", "call", "jmp", "jx", "ret", "sys",
+    "cas", "xadd", "xchg", "fence",
+    "vld", "vst", "vdup", "vadd", "vsub", "vmul", "vand", "vceq", "vcgt", "vsum", "vmax",
+    "divmagic", "nop", "label",
+  };
+
+  for( size_t i = 0; i < img.codes.size(); i++ ) {
+    auto& op = img.codes[i];
+
+    if( op.kind == Kind::Nop )
+      continue;
+
+    printf("  %4zu  %-6s rd=%-2d ra=%-2d rb=%-2d type=%d value=%s%zX\n",
+      i, names[(int)op.kind], op.rd, op.ra, op.rb, (int)op.data_type,
+      op.with_value ? "#" : "", op.value);
+  }
+}
+
+} // namespace
+
+size_t differential(size_t count, u64 seed) {
+  Generator gen{ seed };
+  Runner runner;
+  size_t failed = 0;
+
+  for( size_t n = 0; n < count; n++ ) {
+    Image img = gen.make();
+    std::string diff = runner.diverges(img, true);
+
+    if( diff.empty() )
+      continue;
+
+    failed++;
+
+    Image small = minimize(runner, img);
+
+    printf("program %zu ( seed %zu ) diverges: %s\n", n, seed, diff.c_str());
+    printf("minimized: %s\n", runner.diverges(small, false).c_str());
+    dump(small);
+  }
+
+  auto& engines = runner.all();
+
+  printf("\n%zu programs, %zu divergent\n\n", count, failed);
+
+  for( size_t i = 0; i < engines.size(); i++ ) {
+    double ns = runner.best_ns[i] / std::max<size_t>(count, 1);
+
+    printf("  %-24s %10.1f ns/program  x%.2f\n", engines[i].name.c_str(), ns,
+      runner.best_ns[0] / std::max(runner.best_ns[i], 1.0));
+  }
+
+  return failed;
+}
+
+} // namespace metro::harness
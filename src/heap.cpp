@@ -0,0 +1,481 @@
+#include <algorithm>
+#include "metro.h"
+
+namespace metro::vm {
+
+namespace {
+
+// written by the guest too, only the mark is read
+struct Header {
+  u32   magic;
+  u32   unused[3];
+};
+
+static_assert(sizeof(Header) == Heap::Align);
+
+constexpr u32 Magic = 0x4D48454D;   // live
+constexpr u32 Freed = 0x46524545;   // in a free list
+
+// a chunk of a class is carved into blocks at once
+constexpr size_t ChunkSize = 2 * Heap::PageSize;
+
+// a cache keeps at most this many blocks per class
+constexpr u32 CacheMax = 64;
+
+constexpr size_t align_up(size_t n) {
+  return (n + Heap::Align - 1) & ~(Heap::Align - 1);
+}
+
+constexpr size_t page_align(size_t n) {
+  return (n + Heap::PageSize - 1) & ~(Heap::PageSize - 1);
+}
+
+constexpr size_t block_size(size_t cls) {
+  return Heap::ClassSizes[cls] + sizeof(Header);
+}
+
+// (size + 15) / 16 => size class
+constexpr auto class_table = [] {
+  std::array<u8, Heap::ClassSizes[Heap::ClassCount - 1] / Heap::Align + 1> t { };
+
+  for( size_t i = 0, c = 0; i < t.size(); i++ ) {
+    while( Heap::ClassSizes[c] < i * Heap::Align )
+      c++;
+
+    t[i] = c;
+  }
+
+  return t;
+}();
+
+size_t class_of(size_t size) {
+  if( size > Heap::ClassSizes[Heap::ClassCount - 1] )
+    return Heap::ClassCount;
+
+  return class_table[(size + Heap::Align - 1) / Heap::Align];
+}
+
+void add_stats(Heap::Stats& to, Heap::Stats const& st) {
+  to.allocs += st.allocs;
+  to.frees += st.frees;
+  to.reallocs += st.reallocs;
+  to.failed += st.failed;
+
+  for( size_t i = 0; i < Heap::ClassCount; i++ )
+    to.class_allocs[i] += st.class_allocs[i];
+
+  to.large_allocs += st.large_allocs;
+  to.bytes_in_use += st.bytes_in_use;
+}
+
+} // namespace
+
+//
+// Cache
+//
+
+Heap::Cache::Cache(Heap& heap)
+  : heap(&heap)
+{
+  std::lock_guard lock{ heap.mtx };
+  heap.caches.push_back(this);
+}
+
+Heap::Cache::~Cache()
+{
+  for( size_t cls = 0; cls < ClassCount; cls++ )
+    this->heap->flush(cls, *this, 0);
+
+  std::lock_guard lock{ this->heap->mtx };
+  auto& v = this->heap->caches;
+
+  add_stats(this->heap->central, this->stats);
+  v.erase(std::find(v.begin(), v.end(), this));
+}
+
+void* Heap::Cache::alloc(size_t size) {
+  size_t cls = class_of(size ? size : 1);
+
+  if( cls == ClassCount )
+    return this->heap->alloc_large(size, this->stats);
+
+  if( !this->free_list[cls] && !this->heap->refill(cls, *this) ) {
+    this->stats.failed++;
+    return nullptr;
+  }
+
+  u8* block = this->free_list[cls];
+
+  this->free_list[cls] = this->heap->next_of(block, cls);
+  this->count[cls]--;
+
+  ((Header*)block)->magic = Magic;
+
+  this->stats.allocs++;
+  this->stats.class_allocs[cls]++;
+  this->stats.bytes_in_use += ClassSizes[cls];
+
+  return block + sizeof(Header);
+}
+
+void Heap::Cache::free(void* p) {
+  if( !p )
+    return;
+
+  u8* block = (u8*)p - sizeof(Header);
+  auto pg = this->heap->page_of(block);
+
+  if( !pg )
+    return;
+
+  ((Header*)block)->magic = Freed;
+
+  if( pg->cls == ClassCount ) {
+    this->heap->free_large(block, this->stats);
+    return;
+  }
+
+  size_t cls = pg->cls;
+
+  this->heap->set_next(block, this->free_list[cls]);
+  this->free_list[cls] = block;
+
+  this->stats.frees++;
+  this->stats.bytes_in_use -= ClassSizes[cls];
+
+  if( ++this->count[cls] > CacheMax )
+    this->heap->flush(cls, *this, CacheMax / 2);
+}
+
+void* Heap::Cache::realloc(void* p, size_t size) {
+  if( !p )
+    return this->alloc(size);
+
+  u8* block = (u8*)p - sizeof(Header);
+  auto pg = this->heap->page_of(block);
+
+  if( !pg )
+    return nullptr;
+
+  size_t cap = this->heap->capacity_of(block);
+
+  this->stats.reallocs++;
+
+  // still fits, and not too large for it
+  if( size <= cap && (pg->cls == ClassCount || class_of(size) == pg->cls) )
+    return p;
+
+  void* q = this->alloc(size);
+
+  if( q ) {
+    memcpy(q, p, std::min(cap, size));
+    this->free(p);
+  }
+
+  return q;
+}
+
+//
+// Heap
+//
+
+Heap::Heap()
+{
+  this->init(nullptr, 0);
+}
+
+void Heap::init(u8* begin, size_t size) {
+  std::lock_guard lock{ this->mtx };
+
+  this->begin = begin;
+  this->end = begin + size;
+  this->top = begin;
+  this->arena = this->end;
+
+  // not zero filled, pages are written before use
+  if( size / PageSize != this->page_capacity ) {
+    this->page_capacity = size / PageSize;
+    this->pages.reset(new Page[this->page_capacity]);
+  }
+
+  this->pages_used.store(0, std::memory_order_relaxed);
+
+  std::fill(std::begin(this->free_list), std::end(this->free_list), nullptr);
+  this->large_free.clear();
+
+  this->central = { };
+
+  for( auto&& c : this->caches ) {
+    std::fill(std::begin(c->free_list), std::end(c->free_list), nullptr);
+    std::fill(std::begin(c->count), std::end(c->count), 0);
+    c->stats = { };
+  }
+}
+
+/*
+ * links of free lists are stored in the blocks as offset + 1 from begin
+ * ( 0 = end of list ), so the region stays valid at any address.
+ * a link overwritten by the guest ends the list.
+ */
+u8* Heap::next_of(u8* block, size_t cls) const {
+  u64 offs;
+
+  memcpy(&offs, block + sizeof(Header), sizeof(offs));
+
+  if( !offs )
+    return nullptr;
+
+  if( offs - 1 < (size_t)(this->end - this->begin) ) {
+    u8* next = this->begin + offs - 1;
+
+    if( auto pg = this->page_of(next); pg && pg->cls == cls )
+      return next;
+  }
+
+  log_warn("heap: broken free list of class {}", cls);
+  return nullptr;
+}
+
+void Heap::set_next(u8* block, u8* next) {
+  u64 offs = next ? next - this->begin + 1 : 0;
+
+  memcpy(block + sizeof(Header), &offs, sizeof(offs));
+}
+
+Heap::Page const* Heap::page_of(u8 const* block) const {
+  size_t offs = (uintptr_t)block - (uintptr_t)this->begin;
+  size_t index = offs / PageSize;
+
+  if( offs % Align || index >= this->pages_used.load(std::memory_order_acquire) )
+    return nullptr;
+
+  auto pg = &this->pages[index];
+  size_t from = offs - (size_t)pg->run * PageSize;
+
+  if( pg->cls == ClassCount )
+    return from == 0 ? pg : nullptr;
+
+  return from % block_size(pg->cls) == 0 && from + block_size(pg->cls) <= (size_t)pg->pages * PageSize
+    ? pg : nullptr;
+}
+
+// block must be a block ( page_of() is not nullptr )
+size_t Heap::capacity_of(u8 const* block) const {
+  auto pg = this->page_of(block);
+
+  return pg->cls == ClassCount ? pg->pages * PageSize - sizeof(Header) : ClassSizes[pg->cls];
+}
+
+/*
+ * size pages for a chunk of cls ( or a large block ).
+ * lock must be held
+ */
+u8* Heap::take(size_t size, size_t cls) {
+  if( (size_t)(this->arena - this->top) < size )
+    return nullptr;
+
+  u8* p = this->top;
+  u32 first = (p - this->begin) / PageSize;
+  u32 n = size / PageSize;
+
+  for( u32 i = first; i < first + n; i++ )
+    this->pages[i] = { (u32)cls, first, n };
+
+  this->top += size;
+  this->pages_used.store(first + n, std::memory_order_release);
+
+  return p;
+}
+
+void* Heap::alloc_large(size_t size, Stats& st) {
+  std::lock_guard lock{ this->mtx };
+
+  if( size > (size_t)(this->end - this->begin) ) {
+    st.failed++;
+    return nullptr;
+  }
+
+  size_t need = page_align(size + sizeof(Header));
+  u8* block;
+
+  if( auto it = this->large_free.lower_bound(need); it != this->large_free.end() ) {
+    block = it->second;
+    need = it->first;
+    this->large_free.erase(it);
+  }
+  else if( !(block = this->take(need, ClassCount)) ) {
+    st.failed++;
+    return nullptr;
+  }
+
+  ((Header*)block)->magic = Magic;
+
+  st.allocs++;
+  st.large_allocs++;
+  st.bytes_in_use += need - sizeof(Header);
+
+  return block + sizeof(Header);
+}
+
+void Heap::free_large(u8* block, Stats& st) {
+  std::lock_guard lock{ this->mtx };
+  size_t cap = this->capacity_of(block);
+
+  this->large_free.emplace(cap + sizeof(Header), block);
+
+  st.frees++;
+  st.bytes_in_use -= cap;
+}
+
+size_t Heap::refill(size_t cls, Cache& cache) {
+  std::lock_guard lock{ this->mtx };
+
+  size_t bs = block_size(cls);
+  size_t want = ChunkSize / bs;
+  size_t n = 0;
+
+  // blocks flushed by caches
+  for( ; n < want && this->free_list[cls]; n++ ) {
+    u8* b = this->free_list[cls];
+
+    this->free_list[cls] = this->next_of(b, cls);
+    this->set_next(b, cache.free_list[cls]);
+    cache.free_list[cls] = b;
+  }
+
+  // all blocks of a new chunk
+  if( u8* chunk = n < want ? this->take(ChunkSize, cls) : nullptr ) {
+    for( size_t offs = 0; offs + bs <= ChunkSize; offs += bs, n++ ) {
+      u8* b = chunk + offs;
+
+      ((Header*)b)->magic = Freed;
+
+      this->set_next(b, cache.free_list[cls]);
+      cache.free_list[cls] = b;
+    }
+  }
+
+  cache.count[cls] += n;
+  return n;
+}
+
+void Heap::flush(size_t cls, Cache& cache, u32 keep) {
+  std::lock_guard lock{ this->mtx };
+
+  this->flush_locked(cls, cache, keep);
+}
+
+// lock must be held
+void Heap::flush_locked(size_t cls, Cache& cache, u32 keep) {
+  while( cache.count[cls] > keep && cache.free_list[cls] ) {
+    u8* b = cache.free_list[cls];
+
+    cache.free_list[cls] = this->next_of(b, cls);
+    this->set_next(b, this->free_list[cls]);
+    this->free_list[cls] = b;
+
+    cache.count[cls]--;
+  }
+}
+
+void* Heap::arena_alloc(size_t size) {
+  std::lock_guard lock{ this->mtx };
+
+  if( size <= (size_t)(this->end - this->begin) )
+    size = align_up(size ? size : 1);
+
+  if( (size_t)(this->arena - this->top) < size ) {
+    this->central.failed++;
+    return nullptr;
+  }
+
+  this->arena -= size;
+
+  this->central.arena_allocs++;
+  this->central.arena_bytes += size;
+  this->central.arena_peak = std::max(this->central.arena_peak, this->central.arena_bytes);
+
+  return this->arena;
+}
+
+void Heap::arena_reset() {
+  std::lock_guard lock{ this->mtx };
+
+  this->arena = this->end;
+
+  this->central.arena_resets++;
+  this->central.arena_bytes = 0;
+}
+
+bool Heap::owns(void const* p) const {
+  std::lock_guard lock{ this->mtx };
+  auto block = (u8 const*)((uintptr_t)p - sizeof(Header));
+
+  return this->page_of(block) && ((Header const*)block)->magic == Magic;
+}
+
+Heap::State Heap::save() {
+  std::lock_guard lock{ this->mtx };
+  State st { };
+
+  for( auto&& c : this->caches ) {
+    for( size_t cls = 0; cls < ClassCount; cls++ )
+      this->flush_locked(cls, *c, 0);
+
+    add_stats(this->central, c->stats);
+    c->stats = { };
+  }
+
+  auto offset = [this] (u8* p) -> u64 {
+    return p ? p - this->begin + 1 : 0;
+  };
+
+  st.top = this->top - this->begin;
+  st.arena = this->arena - this->begin;
+
+  for( size_t cls = 0; cls < ClassCount; cls++ )
+    st.free_list[cls] = offset(this->free_list[cls]);
+
+  for( auto&& [size, block] : this->large_free )
+    st.large_free.emplace_back(size, block - this->begin);
+
+  st.pages.assign(this->pages.get(), this->pages.get() + this->pages_used.load(std::memory_order_relaxed));
+
+  st.stats = this->central;
+
+  return st;
+}
+
+void Heap::restore(u8* begin, size_t size, State const& st) {
+  this->init(begin, size);
+
+  std::lock_guard lock{ this->mtx };
+
+  this->top = begin + st.top;
+  this->arena = begin + st.arena;
+
+  for( size_t cls = 0; cls < ClassCount; cls++ )
+    this->free_list[cls] = st.free_list[cls] ? begin + st.free_list[cls] - 1 : nullptr;
+
+  for( auto&& [size, offs] : st.large_free )
+    this->large_free.emplace(size, begin + offs);
+
+  std::copy(st.pages.begin(), st.pages.end(), this->pages.get());
+  this->pages_used.store(st.pages.size(), std::memory_order_release);
+
+  this->central = st.stats;
+}
+
+Heap::Stats Heap::stats() const {
+  std::lock_guard lock{ this->mtx };
+  Stats st = this->central;
+
+  for( auto&& c : this->caches )
+    add_stats(st, c->stats);
+
+  st.footprint = this->top - this->begin;
+
+  return st;
+}
+
+} // namespace metro::vm
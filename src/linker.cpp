@@ -0,0 +1,169 @@
+#include "metro.h"
+
+namespace metro::linker {
+
+using namespace metro::vm;
+using assembler::Object;
+
+[[noreturn]]
+static void Err(std::string const& msg) {
+  throw assembler::Error("metro.linker: " + msg);
+}
+
+namespace {
+
+/*
+ * Open addressing hash table of symbols.
+ *
+ * keys are views of Object::Symbol::name, so the objects must outlive it.
+ * the capacity is fixed at construction (load factor <= 0.5).
+ */
+class SymbolTable {
+  struct Entry {
+    u64                   hash;   // 0 = empty
+    Object::Symbol const* sym;
+    u64                   address;
+  };
+
+  std::vector<Entry> table;
+  size_t mask;
+
+  static u64 hash_of(std::string_view s) {
+    u64 h = assembler::hash_source(s);
+    return h ? h : 1;
+  }
+
+public:
+  explicit SymbolTable(size_t count) {
+    size_t cap = 16;
+
+    while( cap < count * 2 )
+      cap <<= 1;
+
+    this->table.resize(cap);
+    this->mask = cap - 1;
+  }
+
+  // returns the entry with same name if already exists
+  Entry const* insert(Object::Symbol const& sym, u64 address) {
+    u64 h = hash_of(sym.name);
+
+    for( size_t i = h & this->mask; ; i = (i + 1) & this->mask ) {
+      auto& e = this->table[i];
+
+      if( e.hash == 0 ) {
+        e = { h, &sym, address };
+        return nullptr;
+      }
+
+      if( e.hash == h && e.sym->name == sym.name )
+        return &e;
+    }
+  }
+
+  Entry const* find(std::string_view name) const {
+    u64 h = hash_of(name);
+
+    for( size_t i = h & this->mask; ; i = (i + 1) & this->mask ) {
+      auto& e = this->table[i];
+
+      if( e.hash == 0 )
+        return nullptr;
+
+      if( e.hash == h && e.sym->name == name )
+        return &e;
+    }
+  }
+};
+
+} // namespace
+
+vm::Image link(std::vector<Object> const& objects) {
+  static constexpr size_t ObjectDataAlign = sizeof(u64);
+
+  Image image;
+
+  std::vector<size_t> code_base, data_base;
+  size_t global_count = 0;
+
+  // layout
+  for( auto&& obj : objects ) {
+    size_t offs = (image.data.size() + ObjectDataAlign - 1) & ~(ObjectDataAlign - 1);
+
+    code_base.emplace_back(image.codes.size());
+    data_base.emplace_back(offs);
+
+    image.codes.insert(image.codes.end(), obj.codes.begin(), obj.codes.end());
+
+    image.data.resize(offs);
+    image.data.insert(image.data.end(), obj.data.begin(), obj.data.end());
+
+    for( auto&& sym : obj.symbols )
+      global_count += sym.global;
+  }
+
+  auto address_of = [&] (size_t i, Object::Symbol const& sym) -> u64 {
+    return sym.offset + (sym.section == Object::Section::Code ? code_base[i] : data_base[i]);
+  };
+
+  // exported symbols
+  SymbolTable globals{ global_count };
+
+  for( size_t i = 0; i < objects.size(); i++ ) {
+    for( auto&& sym : objects[i].symbols ) {
+      if( sym.section == Object::Section::Data )
+        image.data_labels.emplace(sym.global ? sym.name : std::to_string(i) + ":" + sym.name,
+          address_of(i, sym));
+
+      if( !sym.global )
+        continue;
+
+      if( globals.insert(sym, address_of(i, sym)) )
+        Err("multiple definition of '" + sym.name + "'");
+
+      if( sym.section == Object::Section::Code )
+        image.entries.emplace(sym.name, address_of(i, sym));
+    }
+  }
+
+  // relocation
+  for( size_t i = 0; i < objects.size(); i++ ) {
+    auto& obj = objects[i];
+    SymbolTable locals{ obj.symbols.size() };
+
+    for( auto&& sym : obj.symbols )
+      locals.insert(sym, address_of(i, sym));
+
+    for( auto&& rel : obj.relocs ) {
+      auto e = locals.find(rel.name);
+
+      if( !e && !(e = globals.find(rel.name)) )
+        Err("undefined reference to '" + rel.name + "'");
+
+      if( e->sym->section != rel.section )
+        Err("'" + rel.name + "' is not a " +
+          (rel.section == Object::Section::Code ? "code" : "data") + " label");
+
+      image.codes[code_base[i] + rel.index].value = e->address;
+    }
+  }
+
+  // inline cache slots, and names of host system calls
+  for( auto&& op : image.codes ) {
+    if( op.kind == Asm::Kind::Jumpx )
+      op.value = image.jump_sites++;
+
+    if( op.kind == Asm::Kind::SysCall && op.value == SysCallTable::ByName ) {
+      auto it = std::find(image.sys_names.begin(), image.sys_names.end(), op.str);
+
+      op.value = SysCallTable::ByName + (it - image.sys_names.begin());
+
+      if( it == image.sys_names.end() )
+        image.sys_names.push_back(op.str);
+    }
+  }
+
+  return image;
+}
+
+} // namespace metro::linker
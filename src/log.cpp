@@ -0,0 +1,340 @@
+#include <atomic>
+#include <condition_variable>
+#include "metro.h"
+
+namespace metro::log {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t BufferSize = 1 << 16;    // for each thread
+constexpr auto Interval = std::chrono::milliseconds(10);
+
+char const* const level_names[] = {
+  "trace", "debug", "info", "warn", "error", "fatal",
+};
+
+/*
+ * record:
+ *   | Header | arguments ( Encoder::buf ) |
+ */
+struct Header {
+  Site const*   site;
+  u64           ns;         // from start of the logger
+  u32           thread;
+  u16           size;       // of arguments
+};
+
+/*
+ * ring of records.
+ * written by its thread only, read by the writer ( under Logger::mtx ).
+ * head and tail only grow.
+ */
+struct Buffer {
+  u8                    data[BufferSize];
+  std::atomic<size_t>   head = 0;
+  std::atomic<size_t>   tail = 0;
+  u32                   thread;
+
+  explicit Buffer(u32 thread)
+    : thread(thread)
+  {
+  }
+
+  bool push(void const* p, size_t n) {
+    size_t h = this->head.load(std::memory_order_relaxed);
+
+    if( BufferSize - (h - this->tail.load(std::memory_order_acquire)) < n )
+      return false;
+
+    this->copy_in(h, p, n);
+    this->head.store(h + n, std::memory_order_release);
+
+    return true;
+  }
+
+  void copy_in(size_t pos, void const* p, size_t n) {
+    size_t at = pos % BufferSize;
+    size_t first = std::min(n, BufferSize - at);
+
+    memcpy(this->data + at, p, first);
+    memcpy(this->data, (u8 const*)p + first, n - first);
+  }
+
+  void copy_out(size_t pos, void* p, size_t n) const {
+    size_t at = pos % BufferSize;
+    size_t first = std::min(n, BufferSize - at);
+
+    memcpy(p, this->data + at, first);
+    memcpy((u8*)p + first, this->data, n - first);
+  }
+};
+
+class Logger {
+  std::mutex                            mtx;
+  std::condition_variable               cv;
+  std::vector<std::shared_ptr<Buffer>>  buffers;
+  std::thread                           writer;
+  bool                                  stop = false;
+  u32                                   next_thread = 0;
+  FILE*                                 out = stderr;
+
+public:
+  Clock::time_point const   start = Clock::now();
+  std::atomic<u64>          dropped = 0;
+
+  // never destroyed, records can be written during exit
+  static Logger& get() {
+    static Logger* const logger = new Logger;
+
+    return *logger;
+  }
+
+  Buffer& local() {
+    thread_local std::shared_ptr<Buffer> const buf = [this] {
+      std::lock_guard lock{ this->mtx };
+      auto b = std::make_shared<Buffer>(this->next_thread++);
+
+      this->buffers.push_back(b);
+      return b;
+    }();
+
+    return *buf;
+  }
+
+  void notify() {
+    this->cv.notify_one();
+  }
+
+  void set_output(FILE* fp) {
+    std::lock_guard lock{ this->mtx };
+
+    this->drain();
+    this->out = fp;
+  }
+
+  void flush() {
+    std::lock_guard lock{ this->mtx };
+
+    this->drain();
+  }
+
+  [[noreturn]] void fatal(char const* file, u32 line, std::string const& msg, int code) {
+    u32 thread = this->local().thread;
+
+    {
+      std::lock_guard lock{ this->mtx };
+
+      this->drain();
+      this->print_prefix(Level::Fatal, file, line, this->now(), thread);
+      fprintf(this->out, "%s\n", msg.c_str());
+      fflush(this->out);
+    }
+
+    std::exit(code);
+  }
+
+  u64 now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - this->start).count();
+  }
+
+private:
+  Logger() {
+    this->writer = std::thread([this] {
+      std::unique_lock lock{ this->mtx };
+
+      while( !this->stop ) {
+        this->cv.wait_for(lock, Interval);
+        this->drain();
+      }
+    });
+
+    std::atexit([] {
+      Logger::get().shutdown();
+    });
+  }
+
+  void shutdown() {
+    {
+      std::lock_guard lock{ this->mtx };
+
+      this->stop = true;
+    }
+
+    this->cv.notify_one();
+    this->writer.join();
+
+    this->flush();
+  }
+
+  // mtx is held
+  void drain() {
+    for( size_t i = 0; i < this->buffers.size(); ) {
+      auto& b = *this->buffers[i];
+
+      /*
+       * thread exited: seen before head is read, so a record pushed just
+       * before the exit is drained here and not lost with the buffer.
+       */
+      bool exited = this->buffers[i].use_count() == 1;
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      size_t t = b.tail.load(std::memory_order_relaxed);
+      size_t h = b.head.load(std::memory_order_acquire);
+
+      while( t != h ) {
+        Header hd;
+        u8 args[Encoder::Capacity];
+
+        b.copy_out(t, &hd, sizeof(hd));
+        b.copy_out(t + sizeof(hd), args, hd.size);
+        t += sizeof(hd) + hd.size;
+
+        this->print(hd, args);
+      }
+
+      b.tail.store(t, std::memory_order_release);
+
+      if( exited )
+        this->buffers.erase(this->buffers.begin() + i);
+      else
+        i++;
+    }
+
+    fflush(this->out);
+  }
+
+  void print_prefix(Level level, char const* file, u32 line, u64 ns, u32 thread) {
+    if( auto p = strrchr(file, '/') )
+      file = p + 1;
+
+    fprintf(this->out, "%12.6f T%-3u %-5s %s:%u: ", ns / 1e9, thread,
+      level_names[(int)level], file, line);
+  }
+
+  void print(Header const& hd, u8 const* args) {
+    auto& site = *hd.site;
+    size_t pos = 0;
+
+    this->print_prefix(site.level, site.file, site.line, hd.ns, hd.thread);
+
+    for( char const* f = site.format; *f; f++ ) {
+      if( f[0] != '{' || f[1] != '}' ) {
+        fputc(*f, this->out);
+        continue;
+      }
+
+      f++;
+
+      if( pos >= hd.size ) {
+        fputs("{}", this->out);
+        continue;
+      }
+
+      auto tag = static_cast<Encoder::Tag>(args[pos++]);
+      u64 x = 0;
+
+      if( tag == Encoder::Tag::String ) {
+        u16 len;
+
+        memcpy(&len, args + pos, sizeof(len));
+        fwrite(args + pos + sizeof(len), 1, len, this->out);
+        pos += sizeof(len) + len;
+        continue;
+      }
+
+      if( tag == Encoder::Tag::Bool ) {
+        fputs(args[pos++] ? "true" : "false", this->out);
+        continue;
+      }
+
+      memcpy(&x, args + pos, sizeof(x));
+      pos += sizeof(x);
+
+      switch( tag ) {
+        case Encoder::Tag::Unsigned:
+          fprintf(this->out, "%zu", x);
+          break;
+
+        case Encoder::Tag::Signed:
+          fprintf(this->out, "%zd", (i64)x);
+          break;
+
+        case Encoder::Tag::Float: {
+          double d;
+
+          memcpy(&d, &x, sizeof(d));
+          fprintf(this->out, "%g", d);
+          break;
+        }
+
+        case Encoder::Tag::Pointer:
+          fprintf(this->out, "0x%zx", x);
+          break;
+      }
+    }
+
+    fputc('\n', this->out);
+  }
+};
+
+} // namespace
+
+void Encoder::scalar(Tag tag, void const* p, size_t n) {
+  if( this->size + 1 + n > Capacity )
+    return;
+
+  this->buf[this->size++] = static_cast<u8>(tag);
+  memcpy(this->buf + this->size, p, n);
+  this->size += n;
+}
+
+void Encoder::string(std::string_view s) {
+  if( this->size + 1 + sizeof(u16) > Capacity )
+    return;
+
+  u16 len = std::min(s.length(), Capacity - this->size - 1 - sizeof(u16));
+
+  this->buf[this->size++] = static_cast<u8>(Tag::String);
+  memcpy(this->buf + this->size, &len, sizeof(len));
+  memcpy(this->buf + this->size + sizeof(len), s.data(), len);
+  this->size += sizeof(len) + len;
+}
+
+void commit(Site const& site, Encoder const& args) {
+  auto& L = Logger::get();
+  auto& buf = L.local();
+
+  Header hd{ &site, L.now(), buf.thread, (u16)args.size };
+  u8 rec[sizeof(Header) + Encoder::Capacity];
+
+  memcpy(rec, &hd, sizeof(hd));
+  memcpy(rec + sizeof(hd), args.buf, args.size);
+
+  if( !buf.push(rec, sizeof(hd) + args.size) )
+    L.dropped.fetch_add(1, std::memory_order_relaxed);
+
+  // warnings and errors are written without waiting the interval
+  if( site.level >= Level::Warn )
+    L.notify();
+}
+
+void flush() {
+  Logger::get().flush();
+}
+
+void set_output(FILE* fp) {
+  Logger::get().set_output(fp);
+}
+
+u64 dropped() {
+  return Logger::get().dropped.load(std::memory_order_relaxed);
+}
+
+void fatal(char const* file, u32 line, std::string const& msg, int code) {
+  Logger::get().fatal(file, line, msg, code);
+}
+
+} // namespace metro::log
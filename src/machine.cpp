@@ -1,17 +1,321 @@
 #include <iostream>
 #include <cstring>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <sys/mman.h>
 #include "metro.h"
 
 namespace metro::vm {
 
-void Machine::execute_code(std::vector<Asm> const& codes) {
+namespace {
 
-  cpu.sp = this->stack;
+// calls fn if the scope is left by an exception ( a guest fault )
+template <class F>
+struct OnUnwind {
+  F fn;
+  int const count = std::uncaught_exceptions();
+
+  ~OnUnwind() {
+    if( std::uncaught_exceptions() > this->count )
+      this->fn();
+  }
+};
+
+template <class F>
+OnUnwind(F) -> OnUnwind<F>;
+
+} // namespace
+
+Machine::Machine(MemoryMode mode)
+  : mode(mode),
+    memory(nullptr),
+    memory_size(0),
+    memory_base(0),
+    data(nullptr),
+    data_size(0),
+    stack(nullptr)
+{
+  this->map_memory(0);
+  this->select_policy();
+}
+
+Machine::~Machine()
+{
+  // memory is of root
+  if( this->root != this )
+    return;
+
+  this->stopping.store(true, std::memory_order_relaxed);
+  this->join_all();
+
+  // caches must not touch the memory after this
+  this->heap->init(nullptr, 0);
+
+  munmap(this->memory, this->memory_size);
+}
+
+void Machine::map_memory(size_t data_size) {
+  size_t data_area = (data_size + DataAlign - 1) & ~(DataAlign - 1);
+  size_t size = data_area + HeapSize + StackSize;
+
+  if( this->memory )
+    munmap(this->memory, this->memory_size);
+
+  // page aligned, zero filled
+  auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if( p == MAP_FAILED )
+    panic("cannot allocate memory of machine");
+
+  this->memory = (u8*)p;
+  this->memory_size = size;
+
+  this->set_layout(data_size);
+
+  this->heap->init(this->memory + data_area, HeapSize);
+}
+
+// pointers into the memory
+void Machine::set_layout(size_t data_size) {
+  size_t data_area = (data_size + DataAlign - 1) & ~(DataAlign - 1);
+
+  this->memory_base = this->mode == MemoryMode::Host ? (u64)this->memory : MemoryBase;
+
+  this->data = this->memory;
+  this->data_size = data_size;
+
+  this->stack = (u64*)(this->memory + data_area + HeapSize);
+}
+
+void Machine::load(Image const& image) {
+  this->map_memory(image.data.size());
+  this->link(image);
+
+  memcpy(this->data, image.data.data(), image.data.size());
+}
+
+void Machine::link(Image const& image) {
+  this->jump_sites.assign(image.jump_sites, { });
+  this->jump_codes = nullptr;
+
+  this->sys_names = image.sys_names;
+  this->sys_resolved = false;
+}
+
+void Machine::load(std::shared_ptr<Program const> prog) {
+  this->load(prog->image());
+  this->program = std::move(prog);
+}
+
+void Machine::on_syscall(u64 number, SysCallHandler handler) {
+  this->on_syscall(number, "", std::move(handler));
+}
+
+void Machine::on_syscall(u64 number, std::string name, SysCallHandler handler) {
+  this->own_syscalls_for(number).bind(number, std::move(name), std::move(handler));
+}
+
+SysCallTable& Machine::own_syscalls_for(u64 number) {
+  if( number < HostSysCallBase )
+    panic("system call " << number << " is reserved for the VM");
+
+  auto root = this->root;
+
+  if( root->syscalls == SysCallTable::global() ) {
+    root->own_syscalls = std::make_shared<SysCallTable>(*root->syscalls);
+    root->syscalls = root->own_syscalls;
+  }
+
+  root->sys_resolved = false;
+
+  return *root->own_syscalls;
+}
+
+void Machine::resolve_syscalls() {
+  this->sys_numbers.resize(this->sys_names.size());
+
+  for( size_t i = 0; i < this->sys_names.size(); i++ ) {
+    auto n = this->root->syscalls->find(this->sys_names[i]);
+
+    if( !n )
+      this->fault("unknown system call '" + this->sys_names[i] + "'");
+
+    this->sys_numbers[i] = *n;
+  }
+
+  this->sys_resolved = true;
+}
+
+void Machine::fault(std::string reason) {
+  log_debug("fault: {}, pc = {}", reason, cpu.pc);
+
+  this->last_fault = std::move(reason);
+  throw GuestFault{ };
+}
+
+void Machine::fault(u64 addr, size_t size) {
+  std::ostringstream ss;
+
+  ss << "memory access violation: address 0x" << std::hex << addr << ", " << std::dec << size << " bytes";
+  this->fault(ss.str());
+}
+
+u8* Machine::heap_ptr(u64 addr) {
+  auto p = this->host_ptr(addr, 1);
+
+  if( !this->heap->owns(p) ) {
+    std::ostringstream ss;
+
+    ss << "invalid heap address: 0x" << std::hex << addr;
+    this->fault(ss.str());
+  }
+
+  return p;
+}
+
+void Machine::jump_miss(Asm const& op, u64 target, size_t code_size) {
+  if( target >= code_size && target != (u64)-1 )
+    this->fault("jump to out of code: " + std::to_string(target));
+
+  if( op.value >= this->jump_sites.size() )
+    this->jump_sites.resize(op.value + 1);
+
+  auto& site = this->jump_sites[op.value];
+
+  site.pc = cpu.pc;
+  site.misses++;
+
+  if( site.count < JumpCacheSize )
+    site.targets[site.count++] = target;
+}
+
+void Machine::execute_code(std::vector<Asm> const& codes, u64 entry) {
+  this->start(entry);
+  this->run(codes);
+}
+
+void Machine::start(u64 entry) {
+  cpu.registers[13] = this->guest_addr((u8*)this->stack);  // sp
   cpu.lr = (u64)-1;
+  cpu.pc = entry;
+  cpu.ret_depth = 0;
+}
+
+Machine::RunStatus Machine::run(std::vector<Asm> const& codes, Budget const& budget) {
+  bool metered = budget.limited();
+  auto cs = &codes;
+
+  // codes of the program replaced by the last reload
+  if( this->retired && cs == &this->retired->codes() )
+    cs = &this->program->codes();
+
+  // safe point of hot reload
+  if( this->reload_requested.load(std::memory_order_relaxed) && this->apply_reload(*cs) )
+    cs = &this->program->codes();
+
+  try {
+    return (this->*this->runners[metered])(*cs, budget);
+  }
+  catch( GuestFault const& ) {
+    return RunStatus::Fault;
+  }
+}
+
+template <Machine::MemoryMode Mode, bool Instrumented>
+static void select_runners(Machine::Runner (&runners)[2]) {
+  runners[0] = &Machine::run_with<Machine::Policy<Mode, Instrumented, false>>;
+  runners[1] = &Machine::run_with<Machine::Policy<Mode, Instrumented, true>>;
+}
+
+void Machine::select_policy() {
+  using M = MemoryMode;
+
+  if( this->mode == M::Guest ) {
+    if( this->profile ) select_runners<M::Guest, true>(this->runners);
+    else                select_runners<M::Guest, false>(this->runners);
+  }
+  else {
+    if( this->profile ) select_runners<M::Host, true>(this->runners);
+    else                select_runners<M::Host, false>(this->runners);
+  }
+}
+
+void Machine::set_profile(MemoryProfile* prof) {
+  this->profile = prof;
+  this->select_policy();
+}
+
+/*
+ * the dispatch loop, specialized by P ( see Machine::Policy ).
+ * features off in P are not in the code at all.
+ */
+template <class P>
+Machine::RunStatus Machine::run_with(std::vector<Asm> const& codes, Budget const& budget) {
+  auto cs = &codes;   // changed by hot reload
+
+  auto const& K = this->kernels ? *this->kernels : simd::kernels();
+
+  this->codes = &codes;
+  this->budget = &budget;
+
+  // cached jx targets were validated for other codes
+  if( this->jump_codes != cs ) {
+    for( auto&& site : this->jump_sites )
+      site.count = 0;
+
+    this->jump_codes = cs;
+  }
+
+  u64 used = 0;
+  u64 block = cpu.pc;   // first instruction of current block
+  u64 jumps = 0;
+  u64 jump_hits = 0;
+  u64 jump_misses = 0;
+  [[maybe_unused]] bool has_deadline = budget.deadline != Clock::time_point::max();
+
+  auto begin = Clock::now();
+
+  // counted once per run, nothing in the loop
+  auto finish = [&] (RunStatus st) {
+    auto& M = metrics::vm();
+
+    this->fuel_used = used;
 
-  for( cpu.pc = 0; cpu.pc != (u64)-1 && cpu.pc < codes.size(); ) {
-    auto const& op = codes[cpu.pc];
+    M.runs.add();
+    M.instructions.add(used);
+    M.branches.add(jumps);
+    M.jump_cache_hits.add(jump_hits);
+    M.jump_cache_misses.add(jump_misses);
+    M.run_latency.observe(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count());
+
+    return st;
+  };
+
+  // nothing executed yet
+  if( !this->sys_resolved ) {
+    try {
+      this->resolve_syscalls();
+    }
+    catch( GuestFault const& ) {
+      finish(RunStatus::Fault);
+      throw;
+    }
+  }
+
+  // a fault leaves at cpu.pc, which is counted ( run() returns Fault )
+  OnUnwind on_fault{ [&] {
+    if( cpu.pc >= block && cpu.pc != (u64)-1 )
+      used += cpu.pc + 1 - block;
+
+    finish(RunStatus::Fault);
+  } };
+
+  while( cpu.pc != (u64)-1 && cpu.pc < cs->size() ) {
+    auto const& op = (*cs)[cpu.pc];
+    u64 const at = cpu.pc;
 
     switch( op.kind ) {
       case Asm::Kind::Mov:
@@ -47,34 +351,72 @@ void Machine::execute_code(std::vector<Asm> const& codes) {
 
         break;
 
+      // unsigned, a divisor of 0 is a fault ( SIGFPE on the host )
       case Asm::Kind::Div:
-        if( op.with_value ) cpu.registers[op.rd] = cpu.registers[op.ra] / op.value;
-        else                cpu.registers[op.rd] = cpu.registers[op.ra] / cpu.registers[op.rb];
+      case Asm::Kind::Mod: {
+        u64 d = op.with_value ? op.value : cpu.registers[op.rb];
+
+        if( d == 0 )
+          this->fault("division by zero");
+
+        if( op.kind == Asm::Kind::Div )
+          cpu.registers[op.rd] = cpu.registers[op.ra] / d;
+        else
+          cpu.registers[op.rd] = cpu.registers[op.ra] % d;
+
+        break;
+      }
+
+      case Asm::Kind::Lst:
+        if( op.with_value ) cpu.registers[op.rd] = cpu.registers[op.ra] << (op.value & 63);
+        else                cpu.registers[op.rd] = cpu.registers[op.ra] << (cpu.registers[op.rb] & 63);
+
+        break;
+
+      case Asm::Kind::Rst:
+        if( op.with_value ) cpu.registers[op.rd] = cpu.registers[op.ra] >> (op.value & 63);
+        else                cpu.registers[op.rd] = cpu.registers[op.ra] >> (cpu.registers[op.rb] & 63);
 
         break;
 
-      case Asm::Kind::Mod:
-        if( op.with_value ) cpu.registers[op.rd] = cpu.registers[op.ra] % op.value;
-        else                cpu.registers[op.rd] = cpu.registers[op.ra] % cpu.registers[op.rb];
+      case Asm::Kind::And:
+        if( op.with_value ) cpu.registers[op.rd] = cpu.registers[op.ra] & op.value;
+        else                cpu.registers[op.rd] = cpu.registers[op.ra] & cpu.registers[op.rb];
 
         break;
 
+      case Asm::Kind::DivMagic: {
+        u64 n = cpu.registers[op.ra];
+        u64 q = (u64)(((unsigned __int128)n * op.value) >> 64);
+
+        if( op.rb & 0x80 )
+          q = ((n - q) >> 1) + q;
+
+        cpu.registers[op.rd] = q >> (op.rb & 0x3F);
+        break;
+      }
+
       case Asm::Kind::Load: {
+        u64 addr = cpu.registers[op.rb] + op.value;
+
+        if constexpr( P::instrumented )
+          this->profile->record(cpu.pc, addr, (u64)1 << (int)op.data_type, false);
+
         switch( op.data_type ) {
           case Asm::DataType::Byte:
-            cpu.registers[op.ra] = *(u8*)(cpu.registers[op.rb] + op.value);
+            cpu.registers[op.ra] = *(u8*)this->host_ptr<P::mode>(addr, 1);
             break;
 
           case Asm::DataType::Harf:
-            cpu.registers[op.ra] = *(u16*)(cpu.registers[op.rb] + op.value);
+            cpu.registers[op.ra] = *(u16*)this->host_ptr<P::mode>(addr, 2);
             break;
 
           case Asm::DataType::Word:
-            cpu.registers[op.ra] = *(u32*)(cpu.registers[op.rb] + op.value);
+            cpu.registers[op.ra] = *(u32*)this->host_ptr<P::mode>(addr, 4);
             break;
 
           case Asm::DataType::Long:
-            cpu.registers[op.ra] = *(u64*)(cpu.registers[op.rb] + op.value);
+            cpu.registers[op.ra] = *(u64*)this->host_ptr<P::mode>(addr, 8);
             break;
         }
 
@@ -86,43 +428,41 @@ void Machine::execute_code(std::vector<Asm> const& codes) {
         u64 addr = cpu.registers[op.rb] + op.value;
         u64 val  = cpu.registers[op.ra];
 
+        if constexpr( P::instrumented )
+          this->profile->record(cpu.pc, addr, (u64)1 << (int)op.data_type, true);
+
         switch( op.data_type ) {
           case Asm::DataType::Byte:
-            *(u8*)addr = val & 0xFF;
+            *(u8*)this->host_ptr<P::mode>(addr, 1) = val & 0xFF;
             break;
 
           case Asm::DataType::Harf:
-            *(u16*)addr = val & 0xFFFF;
+            *(u16*)this->host_ptr<P::mode>(addr, 2) = val & 0xFFFF;
             break;
 
           case Asm::DataType::Word:
-            *(u32*)addr = val & 0xFFFFFF;
+            *(u32*)this->host_ptr<P::mode>(addr, 4) = val & 0xFFFFFFFF;
             break;
 
           case Asm::DataType::Long:
-            *(u64*)addr = val;
+            *(u64*)this->host_ptr<P::mode>(addr, 8) = val;
             break;
         }
 
-        /*
-        u64 mask = (~0ULL) << (int)std::pow(2, static_cast<int>(op.data_type) + 1) * 4;
-        なぜ Long のときゼロにならない？！
-
-        printf("%d\n", op.data_type);
-        printf("%016zX\n", mask);
-
-        *(u64*)(cpu.registers[op.rb] + op.value)
-          = (*(u64*)(cpu.registers[op.rb] + op.value) & mask) | (cpu.registers[op.ra] & ~mask);
-        */
-
         cpu.registers[op.rb] += op.rd;
         break;
       }
 
+      case Asm::Kind::Adr:
+        cpu.registers[op.rd] = this->guest_addr(this->data) + op.value;
+        break;
+
       case Asm::Kind::Push: {
         for( int i = 15; i >= 0; i-- ) {
-          if( op.reglist & (1 << i) )
-            *cpu.sp++ = cpu.registers[i];
+          if( op.reglist & (1 << i) ) {
+            *(u64*)this->host_ptr<P::mode>(cpu.registers[13], 8) = cpu.registers[i];
+            cpu.registers[13] += 8;
+          }
         }
 
         break;
@@ -130,65 +470,218 @@ void Machine::execute_code(std::vector<Asm> const& codes) {
 
       case Asm::Kind::Pop: {
         for( int i = 0; i < 16; i++ ) {
-          if( op.reglist & (1 << i) )
-            cpu.registers[i] = *--cpu.sp;
+          if( op.reglist & (1 << i) ) {
+            cpu.registers[13] -= 8;
+            cpu.registers[i] = *(u64*)this->host_ptr<P::mode>(cpu.registers[13], 8);
+          }
         }
 
         break;
       }
 
       case Asm::Kind::Call:
+        // safe point of hot reload, the call is executed again in the new program
+        if( this->reload_requested.load(std::memory_order_relaxed) ) {
+          u64 done = cpu.pc - block;
+
+          if( this->apply_reload(*cs) ) {
+            cs = &this->program->codes();
+            block = cpu.pc - done;
+            continue;
+          }
+        }
+
+        if( cpu.ret_depth == VCPU::ReturnStackDepth )
+          this->fault("return stack overflow");
+
         cpu.lr = cpu.pc + 1;
+        cpu.ret_stack[cpu.ret_depth++] = cpu.lr;
+        [[fallthrough]];
+
+      // target is resolved by linker
+      case Asm::Kind::Jump:
+        used += cpu.pc + 1 - block;
+        cpu.pc = op.value;
+        goto __jumped;
+
+      // -1 halts. a target in the inline cache of the site is valid
+      case Asm::Kind::Jumpx: {
+        u64 target = cpu.registers[op.ra];
+
+        if( op.value < this->jump_sites.size() && this->jump_sites[op.value].holds(target) ) {
+          this->jump_sites[op.value].hits++;
+          jump_hits++;
+        }
+        else {
+          this->jump_miss(op, target, cs->size());
+          jump_misses++;
+        }
 
-      case Asm::Kind::Jump: {
-        for( size_t i = 0; i < codes.size(); i++ ) {
-          if( codes[i].kind == Asm::Kind::Label && codes[i].str == op.str ) {
-            cpu.pc = i + 1;
-            goto xxx;
-          }
+        used += cpu.pc + 1 - block;
+        cpu.pc = target;
+
+        if( cpu.ret_depth && cpu.ret_stack[cpu.ret_depth - 1] == cpu.pc )
+          cpu.ret_depth--;
+
+        goto __jumped;
+      }
+
+      case Asm::Kind::Ret:
+        used += cpu.pc + 1 - block;
+        cpu.pc = cpu.ret_depth ? cpu.ret_stack[--cpu.ret_depth] : (u64)-1;
+        goto __jumped;
+
+      // see syscall.cpp
+      case Asm::Kind::SysCall: {
+        u64 n = op.value;
+
+        // of the host, resolved by resolve_syscalls()
+        if( n >= SysCallTable::ByName ) {
+          if( n - SysCallTable::ByName >= this->sys_numbers.size() )
+            this->fault("unknown system call '" + op.str + "'");
+
+          n = this->sys_numbers[n - SysCallTable::ByName];
         }
 
-        std::cout << "undefined label name '" << op.str << "'" << std::endl;
-        std::exit(1);
+        this->root->syscalls->call(n, *this);
+
+        if( this->retry ) {
+          this->retry = false;
+          used += cpu.pc + 1 - block;
+          goto __jumped;
+        }
 
-      xxx:;
-        continue;
+        break;
       }
 
-      case Asm::Kind::Jumpx:
-        cpu.pc = cpu.registers[op.ra];
+      case Asm::Kind::Cas: {
+        u64 expected = cpu.registers[op.rd];
+
+        // expected = old value, in both cases
+        std::atomic_ref<u64>(this->atomic_word(cpu.registers[op.rb]))
+          .compare_exchange_strong(expected, cpu.registers[op.ra]);
 
-        if( cpu.pc == (u64)-1 )
-          return;
+        cpu.registers[op.rd] = expected;
+        break;
+      }
 
-        continue;
+      case Asm::Kind::Xadd:
+        cpu.registers[op.rd] =
+          std::atomic_ref<u64>(this->atomic_word(cpu.registers[op.rb])).fetch_add(cpu.registers[op.ra]);
+        break;
 
-      case Asm::Kind::SysCall: {
+      case Asm::Kind::Xchg:
+        cpu.registers[op.rd] =
+          std::atomic_ref<u64>(this->atomic_word(cpu.registers[op.rb])).exchange(cpu.registers[op.ra]);
+        break;
 
-        switch( op.value ) {
-          // print char
-          case 0:
-            printf("%c", (char)cpu.registers[0]);
-            break;
+      case Asm::Kind::Fence:
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        break;
 
-          default:
-            todo_impl;
+      case Asm::Kind::VLoad:
+        if constexpr( P::instrumented )
+          this->profile->record(cpu.pc, cpu.registers[op.rb] + op.value, sizeof(VReg), false);
+
+        memcpy(&cpu.vregs[op.ra], this->host_ptr<P::mode>(cpu.registers[op.rb] + op.value, sizeof(VReg)), sizeof(VReg));
+        cpu.registers[op.rb] += op.rd;
+        break;
+
+      case Asm::Kind::VStore:
+        if constexpr( P::instrumented )
+          this->profile->record(cpu.pc, cpu.registers[op.rb] + op.value, sizeof(VReg), true);
+
+        memcpy(this->host_ptr<P::mode>(cpu.registers[op.rb] + op.value, sizeof(VReg)), &cpu.vregs[op.ra], sizeof(VReg));
+        cpu.registers[op.rb] += op.rd;
+        break;
+
+      case Asm::Kind::VDup: {
+        auto& v = cpu.vregs[op.rd];
+        u64 x = cpu.registers[op.ra];
+
+        switch( op.data_type ) {
+          case Asm::DataType::Byte: memset(v.b, (int)(u8)x, sizeof(v)); break;
+          case Asm::DataType::Harf: std::fill(std::begin(v.h), std::end(v.h), (u16)x); break;
+          case Asm::DataType::Word: std::fill(std::begin(v.w), std::end(v.w), (u32)x); break;
+          case Asm::DataType::Long: std::fill(std::begin(v.u), std::end(v.u), x); break;
         }
 
         break;
       }
 
+      case Asm::Kind::VAdd:
+        K.add[(int)op.data_type](cpu.vregs[op.rd], cpu.vregs[op.ra], cpu.vregs[op.rb]);
+        break;
+
+      case Asm::Kind::VSub:
+        K.sub[(int)op.data_type](cpu.vregs[op.rd], cpu.vregs[op.ra], cpu.vregs[op.rb]);
+        break;
+
+      case Asm::Kind::VMul:
+        K.mul[(int)op.data_type](cpu.vregs[op.rd], cpu.vregs[op.ra], cpu.vregs[op.rb]);
+        break;
+
+      case Asm::Kind::VAnd:
+        K.band(cpu.vregs[op.rd], cpu.vregs[op.ra], cpu.vregs[op.rb]);
+        break;
+
+      case Asm::Kind::VCmpEq:
+        K.cmpeq[(int)op.data_type](cpu.vregs[op.rd], cpu.vregs[op.ra], cpu.vregs[op.rb]);
+        break;
+
+      case Asm::Kind::VCmpGt:
+        K.cmpgt[(int)op.data_type](cpu.vregs[op.rd], cpu.vregs[op.ra], cpu.vregs[op.rb]);
+        break;
+
+      case Asm::Kind::VSum:
+        cpu.registers[op.rd] = K.sum[(int)op.data_type](cpu.vregs[op.ra]);
+        break;
+
+      case Asm::Kind::VMax:
+        cpu.registers[op.rd] = K.max[(int)op.data_type](cpu.vregs[op.ra]);
+        break;
+
       /* ignore */
-      case Asm::Kind::Data:
+      case Asm::Kind::Nop:
       case Asm::Kind::Label:
         break;
     }
 
+    // other writes to pc ( mov pc, pop {pc}, ldr pc, .. ) end the block too
+    if( cpu.pc != at ) {
+      used += at + 1 - block;
+      cpu.pc++;
+      goto __jumped;
+    }
+
     cpu.pc++;
-  }
+    continue;
+
+  __jumped:
+    block = cpu.pc;
+    jumps++;
 
+    if( cpu.pc == (u64)-1 )
+      break;
+
+    if constexpr( P::metered ) {
+      // a run in short slices may never reach DeadlineInterval jumps
+      if( used >= budget.fuel )
+        return finish(has_deadline && Clock::now() >= budget.deadline ? RunStatus::Deadline : RunStatus::OutOfFuel);
+
+      if( has_deadline && jumps % DeadlineInterval == 0 && Clock::now() >= budget.deadline )
+        return finish(RunStatus::Deadline);
+
+      if( budget.stop && budget.stop->load(std::memory_order_relaxed) )
+        return finish(RunStatus::Deadline);
+    }
+  }
 
+  // ran off the end
+  if( cpu.pc != (u64)-1 )
+    used += cpu.pc - block;
 
+  return finish(RunStatus::Halted);
 }
 
 } // namespace metro::vm
\ No newline at end of file
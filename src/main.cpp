@@ -1,3 +1,5 @@
+#include <chrono>
+#include <filesystem>
 #include "metro.h"
 
 using namespace metro;
@@ -32,17 +34,256 @@ void test() {
   
 }
 
-int main(int argc, char** argv) {
-  (void)argc;
-  (void)argv;
+/*
+ * throughput of UTF-8 => UTF-16 for .string data (MB/s of input)
+ */
+void bench_utf() {
+  using Clock = std::chrono::steady_clock;
+
+  std::pair<char const*, std::string> const samples[] = {
+    { "ascii", "The quick brown fox jumps over the lazy dog. " },
+    { "cjk",   "メトロのバーチャルマシン、UTF-8 から UTF-16 へ。" },
+    { "mixed", "ascii and ünïcödé mixed, 1/2 of each 😀 " },
+  };
+
+  for( auto&& [name, sample] : samples ) {
+    std::string src;
+
+    while( src.size() < (1 << 20) )
+      src += sample;
+
+    std::vector<char16_t> buf(src.size());
+
+    auto run = [&] (auto&& fn) {
+      constexpr int N = 200;
+      auto begin = Clock::now();
+
+      for( int i = 0; i < N; i++ )
+        fn(buf.data(), (u8 const*)src.data(), src.size());
+
+      double sec = std::chrono::duration<double>(Clock::now() - begin).count();
+
+      return (double)src.size() * N / sec / (1 << 20);
+    };
 
+    printf("%-8s  reference %8.1f MB/s   simd %8.1f MB/s\n",
+      name,
+      run(utf::utf8_to_utf16_reference),
+      run([] (char16_t* o, u8 const* i, size_t n) { return utf::utf8_to_utf16(o, i, n); }));
+  }
+}
+
+int main(int argc, char** argv) {
   using namespace metro::vm;
 
-  auto codes = assembler::assemble_from_file("test.txt");
+  std::vector<std::string> inputs;
+  bool compile_only = false;
+  bool optimize = false;
+  bool heap_stats = false;
+  bool jump_stats = false;
+  bool syscall_stats = false;
+  bool memory_profile = false;
+  std::string snapshot_in, snapshot_out, entry;
+  std::string metrics_out, metrics_socket;
+  Machine::Budget budget;
+  u64 timeout_ms = 0;
+  auto mode = Machine::MemoryMode::Host;
 
-  Machine machine;
+  for( int i = 1; i < argc; i++ ) {
+    std::string arg = argv[i];
 
-  machine.execute_code(codes);
+    if( arg == "--bench-utf" ) {
+      bench_utf();
+      return 0;
+    }
+    else if( arg == "--differential" && i + 1 < argc ) {
+      size_t count = std::stoull(argv[++i]);
+      u64 seed = i + 2 < argc && std::string(argv[i + 1]) == "--seed" ? std::stoull(argv[i + 2]) : 1;
+
+      return harness::differential(count, seed) != 0;
+    }
+    else if( arg == "-c" )
+      compile_only = true;
+    else if( arg == "-O" )
+      optimize = true;
+    else if( arg == "--guest" )
+      mode = Machine::MemoryMode::Guest;
+    else if( arg == "--heap-stats" )
+      heap_stats = true;
+    else if( arg == "--jump-stats" )
+      jump_stats = true;
+    else if( arg == "--syscall-stats" )
+      syscall_stats = true;
+    else if( arg == "--memory-profile" )
+      memory_profile = true;
+    else if( arg == "--snapshot" && i + 1 < argc )
+      snapshot_in = argv[++i];
+    else if( arg == "--save-snapshot" && i + 1 < argc )
+      snapshot_out = argv[++i];
+    else if( arg == "--entry" && i + 1 < argc )
+      entry = argv[++i];
+    else if( arg == "--metrics" && i + 1 < argc )
+      metrics_out = argv[++i];
+    else if( arg == "--metrics-socket" && i + 1 < argc )
+      metrics_socket = argv[++i];
+    else if( arg == "--fuel" && i + 1 < argc )
+      budget.fuel = std::stoull(argv[++i]);
+    else if( arg == "--timeout" && i + 1 < argc )
+      timeout_ms = std::stoull(argv[++i]);
+    else
+      inputs.emplace_back(arg);
+  }
+
+  if( inputs.empty() )
+    inputs.emplace_back("test.txt");
+
+  // a machine from --snapshot is in Guest mode
+  if( !snapshot_out.empty() && mode != Machine::MemoryMode::Guest && snapshot_in.empty() ) {
+    printf("--save-snapshot needs --guest\n");
+    return 1;
+  }
+
+  // scraped while running
+  if( !metrics_socket.empty() && !metrics::serve(metrics_socket) ) {
+    printf("cannot listen on '%s'\n", metrics_socket.c_str());
+    return 1;
+  }
+
+  /*
+   * *.mo is linked as is, other files are assembled into *.mo
+   * unless the object is up to date.
+   */
+  std::vector<assembler::Object> objects;
+  vm::Image image;
+
+  try {
+    for( auto&& path : inputs ) {
+      auto& obj = objects.emplace_back();
+
+      if( path.ends_with(".mo") ) {
+        if( !assembler::read_object(obj, path) ) {
+          printf("cannot read object '%s'\n", path.c_str());
+          return 1;
+        }
+      }
+      else
+        obj = assembler::assemble_cached(path,
+          std::filesystem::path(path).replace_extension(".mo").string());
+    }
+
+    if( compile_only )
+      return 0;
+
+    image = linker::link(objects);
+  }
+  catch( assembler::Error const& e ) {
+    puts(e.what());
+    return 1;
+  }
+
+  if( optimize ) {
+    auto pm = optimizer::default_pipeline();
+
+    for( auto&& st : pm.run(image) )
+      fprintf(stderr, "optimizer: %-24s %8.3f ms  rewritten %zu  removed %zu\n",
+        st.name, st.msec, st.rewritten, st.removed);
+
+    fprintf(stderr, "optimizer: %zu operations removed\n", pm.removed());
+  }
+
+  u64 entry_index = 0;
+
+  if( !entry.empty() ) {
+    auto it = image.entries.find(entry);
+
+    if( it == image.entries.end() ) {
+      printf("entry '%s' is not a global code label\n", entry.c_str());
+      return 1;
+    }
+
+    entry_index = it->second;
+  }
+
+  /*
+   * --snapshot: start from the state saved by --save-snapshot
+   * ( the same program is expected ), instead of a fresh machine.
+   */
+  std::unique_ptr<Machine> mp;
+
+  if( !snapshot_in.empty() ) {
+    std::shared_ptr<Machine::Snapshot const> snap;
+
+    if( !read_snapshot(snap, snapshot_in) ) {
+      printf("cannot read snapshot '%s'\n", snapshot_in.c_str());
+      return 1;
+    }
+
+    mp = std::make_unique<Machine>(*snap);
+    mp->link(image);
+  }
+  else {
+    mp = std::make_unique<Machine>(mode);
+    mp->load(image);
+  }
+
+  auto& machine = *mp;
+
+  /*
+   * --fuel N: run in slices of N instructions, as a scheduler would.
+   * --timeout MS: give up after MS milliseconds.
+   */
+  if( timeout_ms )
+    budget.deadline = Machine::Clock::now() + std::chrono::milliseconds(timeout_ms);
+
+  // --memory-profile: heatmap of loads / stores, reported at exit
+  MemoryProfile profile;
+
+  if( memory_profile )
+    machine.set_profile(&profile);
+
+  Machine::RunStatus status;
+  u64 slices = 0, executed = 0;
+
+  machine.start(entry_index);
+
+  do {
+    status = machine.run(image.codes, budget);
+    executed += machine.fuel_used;
+    slices++;
+  } while( status == Machine::RunStatus::OutOfFuel );
+
+  metrics::stop_serving();
+
+  // also when stopped by the timeout
+  if( memory_profile )
+    profile.report(stderr);
+
+  if( !metrics_out.empty() && !metrics::write_file(metrics_out, metrics::jump_sites(machine)) ) {
+    printf("cannot write metrics '%s'\n", metrics_out.c_str());
+    return 1;
+  }
+
+  if( budget.fuel != ~(u64)0 )
+    fprintf(stderr, "fuel: %zu instructions in %zu slices\n", executed, slices);
+
+  if( status == Machine::RunStatus::Deadline ) {
+    fprintf(stderr, "timeout: stopped at pc = %zu\n", machine.cpu.pc);
+    return 1;
+  }
+
+  if( status == Machine::RunStatus::Fault ) {
+    fprintf(stderr, "fault: %s, pc = %zu\n", machine.last_fault.c_str(), machine.cpu.pc);
+    return 1;
+  }
+
+  if( !snapshot_out.empty() ) {
+    auto snap = machine.snapshot();
+
+    if( !snap || !write_snapshot(snapshot_out, *snap) ) {
+      printf("cannot write snapshot '%s'\n", snapshot_out.c_str());
+      return 1;
+    }
+  }
 
   puts("\n");
 
@@ -56,5 +297,54 @@ int main(int argc, char** argv) {
     printf("stack %p: %016zX\n", machine.stack + i, machine.stack[i]);
   }
 
+  if( jump_stats ) {
+    for( auto&& site : machine.jump_sites ) {
+      if( site.pc == (u64)-1 )
+        continue;
+
+      fprintf(stderr, "jx at %zu: %u targets  hits %zu  misses %zu%s\n",
+        site.pc, site.count, site.hits, site.misses,
+        site.misses > site.count ? "  (megamorphic)" : "");
+    }
+  }
+
+  if( syscall_stats ) {
+    auto const& all = machine.syscalls->all();
+
+    for( size_t n = 0; n < all.size(); n++ ) {
+      auto& e = all[n];
+
+      if( !e.calls )
+        continue;
+
+      // upper bound of the bucket with the median
+      size_t median = 0;
+
+      for( u64 sum = 0; median < SysCallTable::HistogramBuckets; median++ )
+        if( (sum += e.histogram[median]) * 2 >= e.calls )
+          break;
+
+      fprintf(stderr, "sys %3zu %-12s calls %-8zu avg %8zu ns  median < %zu ns\n",
+        n, e.name.c_str(), e.calls, e.total_ns / e.calls, (size_t)2 << median);
+    }
+  }
+
+  if( heap_stats ) {
+    auto st = machine.heap->stats();
+
+    fprintf(stderr, "heap: allocs %zu  frees %zu  reallocs %zu  failed %zu\n",
+      st.allocs, st.frees, st.reallocs, st.failed);
+
+    fprintf(stderr, "heap: in use %zu bytes  footprint %zu bytes  large %zu\n",
+      st.bytes_in_use, st.footprint, st.large_allocs);
+
+    for( size_t i = 0; i < Heap::ClassCount; i++ )
+      if( st.class_allocs[i] )
+        fprintf(stderr, "heap: class %5zu  %zu\n", Heap::ClassSizes[i], st.class_allocs[i]);
+
+    fprintf(stderr, "heap: arena allocs %zu  resets %zu  in use %zu  peak %zu\n",
+      st.arena_allocs, st.arena_resets, st.arena_bytes, st.arena_peak);
+  }
+
 }
 
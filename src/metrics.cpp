@@ -0,0 +1,294 @@
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "metro.h"
+
+namespace metro::metrics {
+
+namespace {
+
+void write_histogram(std::ostringstream& ss, std::string const& name, std::string const& labels,
+    u64 const* buckets, u64 count, u64 sum_ns) {
+  u64 sum = 0;
+  auto sep = labels.empty() ? "" : ",";
+
+  for( size_t i = 0; i < Histogram::Buckets; i++ ) {
+    sum += buckets[i];
+    ss << name << "_bucket{" << labels << sep << "le=\"" << ((double)((u64)2 << i) / 1e9) << "\"} " << sum << "\n";
+  }
+
+  ss << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << count << "\n";
+  ss << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << (sum_ns / 1e9) << "\n";
+  ss << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << count << "\n";
+}
+
+struct Server {
+  std::mutex    mtx;
+  int           fd = -1;
+  std::string   path;
+  std::thread   thread;
+};
+
+Server server;
+
+} // namespace
+
+size_t shard_index() {
+  static std::atomic<size_t> next = 0;
+  thread_local size_t const index = next.fetch_add(1, std::memory_order_relaxed) % Shards;
+
+  return index;
+}
+
+u64 Counter::value() const {
+  u64 sum = 0;
+
+  for( size_t i = 0; i < Shards; i++ )
+    sum += this->shards[i].value.load(std::memory_order_relaxed);
+
+  return sum;
+}
+
+void Histogram::observe(u64 ns) {
+  auto& sh = this->shards[shard_index()];
+  size_t bucket = std::min<size_t>(ns ? std::bit_width(ns) - 1 : 0, Buckets - 1);
+
+  sh.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  sh.count.fetch_add(1, std::memory_order_relaxed);
+  sh.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::read() const {
+  Snapshot snap { };
+
+  for( size_t i = 0; i < Shards; i++ ) {
+    auto& sh = this->shards[i];
+
+    for( size_t b = 0; b < Buckets; b++ )
+      snap.buckets[b] += sh.buckets[b].load(std::memory_order_relaxed);
+
+    snap.count += sh.count.load(std::memory_order_relaxed);
+    snap.sum_ns += sh.sum_ns.load(std::memory_order_relaxed);
+  }
+
+  return snap;
+}
+
+Registry& Registry::global() {
+  static Registry reg;
+
+  return reg;
+}
+
+Counter& Registry::counter(std::string name, std::string help) {
+  std::lock_guard lock{ this->mtx };
+
+  auto& m = this->metrics.emplace_back(std::move(name), std::move(help));
+
+  m.counter = std::make_unique<Counter>();
+  return *m.counter;
+}
+
+Histogram& Registry::histogram(std::string name, std::string help) {
+  std::lock_guard lock{ this->mtx };
+
+  auto& m = this->metrics.emplace_back(std::move(name), std::move(help));
+
+  m.histogram = std::make_unique<Histogram>();
+  return *m.histogram;
+}
+
+std::string Registry::prometheus() const {
+  std::ostringstream ss;
+
+  {
+    std::lock_guard lock{ this->mtx };
+
+    for( auto&& m : this->metrics ) {
+      ss << "# HELP " << m.name << " " << m.help << "\n";
+
+      if( m.counter ) {
+        ss << "# TYPE " << m.name << " counter\n";
+        ss << m.name << " " << m.counter->value() << "\n";
+      }
+      else {
+        auto snap = m.histogram->read();
+
+        ss << "# TYPE " << m.name << " histogram\n";
+        write_histogram(ss, m.name, "", snap.buckets, snap.count, snap.sum_ns);
+      }
+    }
+  }
+
+  // counted by the tables themselves ( see SysCallTable::call )
+  auto totals = vm::SysCallTable::totals();
+
+  ss << "# HELP metro_syscalls_total System calls by number.\n";
+  ss << "# TYPE metro_syscalls_total counter\n";
+
+  for( auto&& t : totals )
+    ss << "metro_syscalls_total{number=\"" << t.number << "\",name=\"" << t.name << "\"} " << t.calls << "\n";
+
+  ss << "# HELP metro_syscall_seconds Latency of system calls.\n";
+  ss << "# TYPE metro_syscall_seconds histogram\n";
+
+  for( auto&& t : totals ) {
+    write_histogram(ss, "metro_syscall_seconds",
+      "number=\"" + std::to_string(t.number) + "\",name=\"" + t.name + "\"",
+      t.histogram, t.calls, t.total_ns);
+  }
+
+  return ss.str();
+}
+
+VM& vm() {
+  static VM m = [] {
+    auto& r = Registry::global();
+
+    return VM{
+      r.counter("metro_instructions_total", "Instructions executed."),
+      r.counter("metro_branches_total", "Jumps, calls and returns taken."),
+      r.counter("metro_runs_total", "Calls of Machine::run."),
+      r.counter("metro_jump_cache_hits_total", "jx targets found in the inline cache of the site."),
+      r.counter("metro_jump_cache_misses_total", "jx targets not in the inline cache of the site."),
+      r.counter("metro_object_cache_hits_total", "Sources with an up-to-date object file."),
+      r.counter("metro_object_cache_misses_total", "Sources assembled again."),
+      r.counter("metro_reloads_total", "Programs replaced by hot reload."),
+      r.histogram("metro_run_seconds", "Latency of Machine::run."),
+      r.histogram("metro_assemble_seconds", "Time to assemble a source."),
+    };
+  }();
+
+  return m;
+}
+
+std::string prometheus() {
+  return Registry::global().prometheus();
+}
+
+std::string jump_sites(vm::Machine const& m) {
+  std::ostringstream ss;
+
+  ss << "# HELP metro_jump_site_hits_total jx targets found in the inline cache, by site.\n";
+  ss << "# TYPE metro_jump_site_hits_total counter\n";
+
+  for( auto&& site : m.jump_sites ) {
+    if( site.pc != (u64)-1 )
+      ss << "metro_jump_site_hits_total{pc=\"" << site.pc << "\"} " << site.hits << "\n";
+  }
+
+  ss << "# HELP metro_jump_site_misses_total jx targets validated and cached, by site.\n";
+  ss << "# TYPE metro_jump_site_misses_total counter\n";
+
+  for( auto&& site : m.jump_sites ) {
+    if( site.pc != (u64)-1 )
+      ss << "metro_jump_site_misses_total{pc=\"" << site.pc << "\"} " << site.misses << "\n";
+  }
+
+  return ss.str();
+}
+
+bool write_file(std::string const& path, std::string const& extra) {
+  auto text = prometheus() + extra;
+  auto tmp = path + ".tmp";
+  auto fp = fopen(tmp.c_str(), "wb");
+
+  if( !fp )
+    return false;
+
+  bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+
+  ok = fclose(fp) == 0 && ok;
+
+  return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool serve(std::string const& path) {
+  std::lock_guard lock{ server.mtx };
+
+  sockaddr_un addr { };
+
+  if( server.fd != -1 || path.size() >= sizeof(addr.sun_path) )
+    return false;
+
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size());
+
+  // a socket left by an earlier run is replaced, other files are not
+  struct stat st;
+
+  if( lstat(path.c_str(), &st) == 0 ) {
+    if( !S_ISSOCK(st.st_mode) )
+      return false;
+
+    unlink(path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if( fd == -1 )
+    return false;
+
+  if( bind(fd, (sockaddr*)&addr, sizeof(addr)) || listen(fd, 8) ) {
+    close(fd);
+    return false;
+  }
+
+  server.fd = fd;
+  server.path = path;
+  server.thread = std::thread([fd] {
+    for( ;; ) {
+      int conn = accept(fd, nullptr, nullptr);
+
+      // shutdown() of the socket ends accept()
+      if( conn == -1 ) {
+        if( errno == EINTR || errno == ECONNABORTED )
+          continue;
+
+        break;
+      }
+
+      auto text = prometheus();
+
+      // no SIGPIPE if the scraper has gone
+      for( size_t done = 0; done < text.size(); ) {
+        auto n = ::send(conn, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+
+        if( n == -1 && errno == EINTR )
+          continue;
+
+        if( n <= 0 )
+          break;
+
+        done += n;
+      }
+
+      close(conn);
+    }
+  });
+
+  log_info("metrics: serving on {}", path);
+
+  return true;
+}
+
+void stop_serving() {
+  std::lock_guard lock{ server.mtx };
+
+  if( server.fd == -1 )
+    return;
+
+  shutdown(server.fd, SHUT_RDWR);
+  server.thread.join();
+
+  close(server.fd);
+  unlink(server.path.c_str());
+
+  server.fd = -1;
+}
+
+} // namespace metro::metrics
@@ -0,0 +1,232 @@
+#include <fstream>
+#include "metro.h"
+
+/*
+ * object file (*.mo)
+ *
+ *  header:
+ *    "MOBJ"  u32 version  u64 source_hash
+ *
+ *  u64 count, codes[count]
+ *    u8 kind, rd, ra, rb, with_value, data_type   u64 value   str
+ *
+ *  u64 size, data[size]
+ *
+ *  u64 count, symbols[count]
+ *    str name   u8 section   u64 offset   u8 global
+ *
+ *  u64 count, relocs[count]
+ *    u64 index   u8 section   str name
+ *
+ *  str = u64 length, chars
+ *  all integers are little endian
+ */
+
+namespace metro::assembler {
+
+using namespace metro::vm;
+
+static constexpr char Magic[4] = { 'M', 'O', 'B', 'J' };
+static constexpr u32 Version = 5;
+
+namespace {
+
+struct Writer {
+  std::vector<u8> buf;
+
+  template <class T>
+  void put(T const& v) {
+    buf.insert(buf.end(), (u8 const*)&v, (u8 const*)&v + sizeof(T));
+  }
+
+  void put_bytes(void const* p, size_t n) {
+    put<u64>(n);
+    buf.insert(buf.end(), (u8 const*)p, (u8 const*)p + n);
+  }
+
+  void put_str(std::string const& s) {
+    put_bytes(s.data(), s.length());
+  }
+};
+
+struct Reader {
+  u8 const* p;
+  u8 const* end;
+  bool ok = true;
+
+  bool has(size_t n) {
+    return ok = ok && (size_t)(end - p) >= n;
+  }
+
+  template <class T>
+  T get() {
+    T v { };
+
+    if( has(sizeof(T)) ) {
+      memcpy(&v, p, sizeof(T));
+      p += sizeof(T);
+    }
+
+    return v;
+  }
+
+  // count of elements, each at least min_size bytes
+  size_t get_count(size_t min_size) {
+    u64 n = get<u64>();
+
+    if( n > (u64)(end - p) || !has(n * min_size) ) {
+      ok = false;
+      return 0;
+    }
+
+    return n;
+  }
+
+  // enum stored in u8, values above last are corrupt
+  template <class E>
+  E get_enum(E last) {
+    u8 v = get<u8>();
+
+    if( v > static_cast<u8>(last) )
+      ok = false;
+
+    return static_cast<E>(v);
+  }
+
+  std::string get_str() {
+    size_t n = get_count(1);
+    std::string s((char const*)p, n);
+
+    p += n;
+    return s;
+  }
+};
+
+} // namespace
+
+bool write_object(std::string const& path, Object const& obj) {
+  Writer w;
+
+  w.buf.insert(w.buf.end(), Magic, Magic + 4);
+  w.put<u32>(Version);
+  w.put<u64>(obj.source_hash);
+
+  w.put<u64>(obj.codes.size());
+
+  for( auto&& op : obj.codes ) {
+    w.put<u8>(static_cast<u8>(op.kind));
+    w.put<u8>(op.rd);
+    w.put<u8>(op.ra);
+    w.put<u8>(op.rb);
+    w.put<u8>(op.with_value);
+    w.put<u8>(static_cast<u8>(op.data_type));
+    w.put<u64>(op.value);
+    w.put_str(op.str);
+  }
+
+  w.put_bytes(obj.data.data(), obj.data.size());
+
+  w.put<u64>(obj.symbols.size());
+
+  for( auto&& sym : obj.symbols ) {
+    w.put_str(sym.name);
+    w.put<u8>(static_cast<u8>(sym.section));
+    w.put<u64>(sym.offset);
+    w.put<u8>(sym.global);
+  }
+
+  w.put<u64>(obj.relocs.size());
+
+  for( auto&& rel : obj.relocs ) {
+    w.put<u64>(rel.index);
+    w.put<u8>(static_cast<u8>(rel.section));
+    w.put_str(rel.name);
+  }
+
+  std::ofstream ofs{ path, std::ios::binary };
+
+  if( ofs.fail() )
+    return false;
+
+  ofs.write((char const*)w.buf.data(), w.buf.size());
+
+  return !ofs.fail();
+}
+
+bool read_object(Object& out, std::string const& path) {
+  std::ifstream ifs{ path, std::ios::binary };
+
+  if( ifs.fail() )
+    return false;
+
+  std::vector<u8> buf{ std::istreambuf_iterator<char>(ifs), { } };
+  Reader r{ buf.data(), buf.data() + buf.size() };
+
+  if( !r.has(4) || memcmp(r.p, Magic, 4) )
+    return false;
+
+  r.p += 4;
+
+  if( r.get<u32>() != Version )
+    return false;
+
+  Object obj;
+
+  obj.source_hash = r.get<u64>();
+
+  obj.codes.resize(r.get_count(22));
+
+  for( auto&& op : obj.codes ) {
+    op.kind = r.get_enum(Asm::Kind::Label);
+    op.rd = r.get<u8>();
+    op.ra = r.get<u8>();
+    op.rb = r.get<u8>();
+    op.with_value = r.get<u8>();
+    op.data_type = r.get_enum(Asm::DataType::String);
+    op.value = r.get<u64>();
+    op.str = r.get_str();
+
+    // index cpu.registers / cpu.vregs
+    if( op.rd >= 16 || op.ra >= 16 || op.rb >= 16 )
+      return false;
+  }
+
+  obj.data.resize(r.get_count(1));
+
+  if( r.ok ) {
+    memcpy(obj.data.data(), r.p, obj.data.size());
+    r.p += obj.data.size();
+  }
+
+  obj.symbols.resize(r.get_count(18));
+
+  for( auto&& sym : obj.symbols ) {
+    sym.name = r.get_str();
+    sym.section = r.get_enum(Object::Section::Data);
+    sym.offset = r.get<u64>();
+    sym.global = r.get<u8>();
+
+    // a label at the end is at size()
+    if( sym.offset > (sym.section == Object::Section::Code ? obj.codes.size() : obj.data.size()) )
+      return false;
+  }
+
+  obj.relocs.resize(r.get_count(17));
+
+  for( auto&& rel : obj.relocs ) {
+    rel.index = r.get<u64>();
+    rel.section = r.get_enum(Object::Section::Data);
+    rel.name = r.get_str();
+
+    if( rel.index >= obj.codes.size() )
+      return false;
+  }
+
+  if( !r.ok || r.p != r.end )
+    return false;
+
+  out = std::move(obj);
+  return true;
+}
+
+} // namespace metro::assembler
@@ -0,0 +1,565 @@
+#include <chrono>
+#include <optional>
+#include "metro.h"
+
+namespace metro::optimizer {
+
+using namespace metro::vm;
+using Kind = Asm::Kind;
+
+namespace {
+
+constexpr u8 SP = 13;
+constexpr u8 LR = 14;
+constexpr u8 PC = 15;
+
+constexpr u32 AllRegs = 0xFFFF;
+
+constexpr u32 bit(u8 r) {
+  return 1u << r;
+}
+
+bool is_alu(Kind k) {
+  return k >= Kind::Add && k <= Kind::And;
+}
+
+// registers written by op
+u32 defs(Asm const& op) {
+  switch( op.kind ) {
+    case Kind::Mov:
+    case Kind::Add:
+    case Kind::Sub:
+    case Kind::Mul:
+    case Kind::Div:
+    case Kind::Mod:
+    case Kind::Lst:
+    case Kind::Rst:
+    case Kind::And:
+    case Kind::Adr:
+    case Kind::DivMagic:
+    case Kind::VSum:
+    case Kind::VMax:
+      return bit(op.rd);
+
+    case Kind::Load:
+      return bit(op.ra) | (op.rd ? bit(op.rb) : 0);
+
+    case Kind::Store:
+    case Kind::VLoad:
+    case Kind::VStore:
+      return op.rd ? bit(op.rb) : 0;
+
+    case Kind::Push:
+      return bit(SP);
+
+    case Kind::Pop:
+      return op.reglist | bit(SP);
+
+    case Kind::Call:
+      return bit(LR) | bit(PC);
+
+    case Kind::Cas:
+    case Kind::Xadd:
+    case Kind::Xchg:
+      return bit(op.rd);
+
+    case Kind::Jump:
+    case Kind::Jumpx:
+    case Kind::Ret:
+      return bit(PC);
+
+    case Kind::SysCall:
+      return AllRegs;
+  }
+
+  return 0;
+}
+
+// registers read by op
+u32 uses(Asm const& op) {
+  switch( op.kind ) {
+    case Kind::Mov:
+      return op.with_value ? 0 : bit(op.ra);
+
+    case Kind::Cmp:
+    case Kind::Add:
+    case Kind::Sub:
+    case Kind::Mul:
+    case Kind::Div:
+    case Kind::Mod:
+    case Kind::Lst:
+    case Kind::Rst:
+    case Kind::And:
+      return bit(op.ra) | (op.with_value ? 0 : bit(op.rb));
+
+    case Kind::DivMagic:
+    case Kind::Jumpx:
+    case Kind::VDup:
+      return bit(op.ra);
+
+    case Kind::Load:
+    case Kind::VLoad:
+    case Kind::VStore:
+      return bit(op.rb);
+
+    case Kind::Store:
+      return bit(op.ra) | bit(op.rb);
+
+    case Kind::Cas:
+      return bit(op.rd) | bit(op.ra) | bit(op.rb);
+
+    case Kind::Xadd:
+    case Kind::Xchg:
+      return bit(op.ra) | bit(op.rb);
+
+    case Kind::Push:
+      return op.reglist | bit(SP);
+
+    case Kind::Pop:
+      return bit(SP);
+
+    case Kind::SysCall:
+      return AllRegs;
+  }
+
+  return 0;
+}
+
+// no side effect other than writing rd
+bool is_pure(Asm const& op) {
+  return op.kind == Kind::Mov || is_alu(op.kind)
+    || op.kind == Kind::Adr || op.kind == Kind::DivMagic;
+}
+
+// end of a basic block
+bool is_boundary(Asm const& op) {
+  return op.kind == Kind::Label || op.kind == Kind::SysCall || (defs(op) & bit(PC));
+}
+
+/*
+ * true if a jump may go to an absolute index written in the program.
+ * (jx by a register other than lr, writing pc directly, or an index taken
+ *  by mov rd, <label> e.g. for spawn)
+ */
+bool has_absolute_jump(std::vector<Asm> const& codes) {
+  for( auto&& op : codes ) {
+    if( op.kind == Kind::Mov && !op.str.empty() )
+      return true;
+
+    if( op.kind == Kind::Jumpx ) {
+      if( op.ra != LR )
+        return true;
+    }
+    else if( op.kind != Kind::Call && op.kind != Kind::Jump && op.kind != Kind::Ret
+        && (defs(op) & bit(PC)) )
+      return true;
+  }
+
+  return false;
+}
+
+std::optional<u64> eval(Kind kind, u64 a, u64 b) {
+  switch( kind ) {
+    case Kind::Add: return a + b;
+    case Kind::Sub: return a - b;
+    case Kind::Mul: return a * b;
+    case Kind::Div: if( b ) return a / b; break;
+    case Kind::Mod: if( b ) return a % b; break;
+    case Kind::Lst: return a << (b & 63);
+    case Kind::Rst: return a >> (b & 63);
+    case Kind::And: return a & b;
+  }
+
+  return std::nullopt;
+}
+
+u64 eval_div_magic(Asm const& op, u64 n) {
+  u64 q = (u64)(((unsigned __int128)n * op.value) >> 64);
+
+  if( op.rb & 0x80 )
+    q = ((n - q) >> 1) + q;
+
+  return q >> (op.rb & 0x3F);
+}
+
+bool is_pow2(u64 v) {
+  return v && !(v & (v - 1));
+}
+
+void make_nop(Asm& op) {
+  op = Asm(Kind::Nop);
+}
+
+void make_mov(Asm& op, u64 value) {
+  op.kind = Kind::Mov;
+  op.with_value = true;
+  op.value = value;
+}
+
+// rd = ra
+void make_copy(Asm& op) {
+  op.kind = Kind::Mov;
+  op.with_value = false;
+  op.value = 0;
+}
+
+/*
+ * Constant folding and propagation in each basic block.
+ *
+ *   mov r1, #3              mov r1, #3
+ *   add r2, r1, #4    =>    mov r2, #7
+ *   mul r3, r0, r2          mul r3, r0, #7
+ */
+class ConstantPropagation : public Pass {
+public:
+  char const* name() const override {
+    return "constant-propagation";
+  }
+
+  size_t run(std::vector<Asm>& codes) override {
+    std::optional<u64> known[16];
+    size_t changes = 0;
+
+    for( auto&& op : codes ) {
+      if( is_boundary(op) ) {
+        for( auto&& k : known )
+          k.reset();
+
+        continue;
+      }
+
+      if( op.kind == Kind::Mov ) {
+        if( !op.with_value && known[op.ra] ) {
+          make_mov(op, *known[op.ra]);
+          changes++;
+        }
+
+        known[op.rd] = op.with_value ? std::optional<u64>(op.value) : known[op.ra];
+      }
+      else if( is_alu(op.kind) ) {
+        auto a = known[op.ra];
+        auto b = op.with_value ? std::optional<u64>(op.value) : known[op.rb];
+
+        if( a && b && eval(op.kind, *a, *b) ) {
+          make_mov(op, *eval(op.kind, *a, *b));
+          changes++;
+        }
+        else if( !op.with_value && b ) {
+          op.with_value = true;
+          op.value = *b;
+          changes++;
+        }
+        else if( !op.with_value && a && (op.kind == Kind::Add || op.kind == Kind::Mul || op.kind == Kind::And) ) {
+          op.ra = op.rb;
+          op.with_value = true;
+          op.value = *a;
+          changes++;
+        }
+
+        known[op.rd] = op.kind == Kind::Mov ? std::optional<u64>(op.value) : std::nullopt;
+      }
+      else if( op.kind == Kind::DivMagic && known[op.ra] ) {
+        make_mov(op, eval_div_magic(op, *known[op.ra]));
+        known[op.rd] = op.value;
+        changes++;
+      }
+      else {
+        for( u32 d = defs(op), r = 0; d; d >>= 1, r++ )
+          if( d & 1 )
+            known[r].reset();
+      }
+    }
+
+    return changes;
+  }
+};
+
+/*
+ * Replace mul / div / mod by a constant with cheaper operations.
+ *
+ *   mul  #2^k  =>  lst #k
+ *   div  #2^k  =>  rst #k
+ *   mod  #2^k  =>  and #(2^k - 1)
+ *   div  #c    =>  DivMagic (multiply by reciprocal)
+ *
+ * and identities like add #0, mul #1.
+ */
+class StrengthReduction : public Pass {
+  /*
+   * magic number for unsigned division by d (not a power of 2).
+   * see "Hacker's Delight" 10-8, and libdivide.
+   */
+  static void div_magic(u64 d, u64& magic, u8& more) {
+    int l = 63 - __builtin_clzll(d);
+
+    unsigned __int128 num = (unsigned __int128)1 << (64 + l);
+    u64 m = (u64)(num / d);
+    u64 rem = (u64)(num % d);
+
+    if( d - rem < (1ull << l) )
+      more = l;
+    else {
+      u64 twice = rem + rem;
+
+      m += m;
+
+      if( twice >= d || twice < rem )
+        m += 1;
+
+      more = l | 0x80;
+    }
+
+    magic = m + 1;
+  }
+
+public:
+  char const* name() const override {
+    return "strength-reduction";
+  }
+
+  size_t run(std::vector<Asm>& codes) override {
+    size_t changes = 0;
+
+    for( auto&& op : codes ) {
+      if( !is_alu(op.kind) || !op.with_value )
+        continue;
+
+      u64 v = op.value;
+      bool changed = true;
+
+      switch( op.kind ) {
+        case Kind::Add:
+        case Kind::Sub:
+          if( v == 0 ) make_copy(op);
+          else changed = false;
+          break;
+
+        case Kind::Lst:
+        case Kind::Rst:
+          if( (v & 63) == 0 ) make_copy(op);
+          else changed = false;
+          break;
+
+        case Kind::And:
+          if( v == ~0ull ) make_copy(op);
+          else if( v == 0 ) make_mov(op, 0);
+          else changed = false;
+          break;
+
+        case Kind::Mul:
+          if( v == 0 ) make_mov(op, 0);
+          else if( v == 1 ) make_copy(op);
+          else if( is_pow2(v) ) {
+            op.kind = Kind::Lst;
+            op.value = __builtin_ctzll(v);
+          }
+          else changed = false;
+          break;
+
+        case Kind::Div:
+          if( v == 0 ) changed = false; // keep the fault
+          else if( v == 1 ) make_copy(op);
+          else if( is_pow2(v) ) {
+            op.kind = Kind::Rst;
+            op.value = __builtin_ctzll(v);
+          }
+          else {
+            u8 more;
+
+            div_magic(v, op.value, more);
+            op.kind = Kind::DivMagic;
+            op.rb = more;
+          }
+          break;
+
+        case Kind::Mod:
+          if( v == 1 ) make_mov(op, 0);
+          else if( is_pow2(v) ) {
+            op.kind = Kind::And;
+            op.value = v - 1;
+          }
+          else changed = false;
+          break;
+      }
+
+      changes += changed;
+    }
+
+    return changes;
+  }
+};
+
+/*
+ * Remove operations whose result is overwritten before read in the same
+ * basic block, and moves to itself.
+ * all registers are live at the end of a block.
+ */
+class DeadStoreElimination : public Pass {
+public:
+  char const* name() const override {
+    return "dead-store-elimination";
+  }
+
+  size_t run(std::vector<Asm>& codes) override {
+    u32 live = AllRegs;
+    size_t changes = 0;
+
+    for( size_t i = codes.size(); i-- > 0; ) {
+      auto& op = codes[i];
+
+      if( op.kind == Kind::Nop )
+        continue;
+
+      if( is_boundary(op) ) {
+        live = AllRegs;
+        continue;
+      }
+
+      u32 d = defs(op);
+
+      if( is_pure(op) && !(d & (bit(SP) | bit(PC))) ) {
+        bool self_move = op.kind == Kind::Mov && !op.with_value && op.rd == op.ra;
+
+        if( self_move || !(d & live) ) {
+          make_nop(op);
+          changes++;
+          continue;
+        }
+      }
+
+      live = (live & ~d) | uses(op);
+    }
+
+    return changes;
+  }
+};
+
+/*
+ * Remove operations after an unconditional jump until the next label.
+ * does nothing if the program may jump to an absolute index.
+ */
+class DeadCodeElimination : public Pass {
+public:
+  char const* name() const override {
+    return "dead-code-elimination";
+  }
+
+  size_t run(std::vector<Asm>& codes) override {
+    if( has_absolute_jump(codes) )
+      return 0;
+
+    bool dead = false;
+    size_t changes = 0;
+
+    for( auto&& op : codes ) {
+      if( op.kind == Kind::Label )
+        dead = false;
+      else if( dead && op.kind != Kind::Nop ) {
+        make_nop(op);
+        changes++;
+      }
+      else if( op.kind == Kind::Jump || op.kind == Kind::Jumpx || op.kind == Kind::Ret )
+        dead = true;
+    }
+
+    return changes;
+  }
+};
+
+size_t count_nop(std::vector<Asm> const& codes) {
+  size_t n = 0;
+
+  for( auto&& op : codes )
+    n += op.kind == Kind::Nop;
+
+  return n;
+}
+
+} // namespace
+
+PassManager& PassManager::add(std::unique_ptr<Pass> pass) {
+  this->passes.emplace_back(std::move(pass));
+  return *this;
+}
+
+std::vector<PassStats> PassManager::run(vm::Image& image) {
+  using Clock = std::chrono::steady_clock;
+
+  auto& codes = image.codes;
+  std::vector<PassStats> stats;
+
+  for( auto&& pass : this->passes ) {
+    size_t nops = count_nop(codes);
+    auto begin = Clock::now();
+
+    size_t changes = pass->run(codes);
+
+    double msec = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    size_t removed = count_nop(codes) - nops;
+
+    stats.push_back({ pass->name(), msec, changes - removed, removed });
+    this->total_removed += removed;
+  }
+
+  if( has_absolute_jump(codes) )
+    return stats;
+
+  // drop Nop and fix jump targets
+  std::vector<size_t> new_index(codes.size() + 1);
+  size_t n = 0;
+
+  for( size_t i = 0; i < codes.size(); i++ ) {
+    new_index[i] = n;
+
+    // self-move would empty .str
+    if( codes[i].kind != Kind::Nop ) {
+      if( n != i )
+        codes[n] = std::move(codes[i]);
+
+      n++;
+    }
+  }
+
+  new_index[codes.size()] = n;
+  codes.resize(n);
+
+  for( auto&& op : codes ) {
+    if( op.kind == Kind::Call || op.kind == Kind::Jump )
+      op.value = new_index[op.value];
+  }
+
+  for( auto&& [name, index] : image.entries )
+    index = new_index[index];
+
+  return stats;
+}
+
+std::unique_ptr<Pass> constant_propagation() {
+  return std::make_unique<ConstantPropagation>();
+}
+
+std::unique_ptr<Pass> strength_reduction() {
+  return std::make_unique<StrengthReduction>();
+}
+
+std::unique_ptr<Pass> dead_store_elimination() {
+  return std::make_unique<DeadStoreElimination>();
+}
+
+std::unique_ptr<Pass> dead_code_elimination() {
+  return std::make_unique<DeadCodeElimination>();
+}
+
+PassManager default_pipeline() {
+  PassManager pm;
+
+  pm.add(constant_propagation())
+    .add(strength_reduction())
+    .add(constant_propagation())
+    .add(dead_store_elimination())
+    .add(dead_code_elimination());
+
+  return pm;
+}
+
+} // namespace metro::optimizer
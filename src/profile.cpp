@@ -0,0 +1,153 @@
+#include <algorithm>
+#include "metro.h"
+
+namespace metro::vm {
+
+void MemoryProfile::record(u64 pc, u64 addr, u64 size, bool store) {
+  auto& site = this->sites[pc];
+
+  if( site.loads + site.stores ) {
+    i64 stride = (i64)(addr - site.last);
+
+    if( auto it = site.strides.find(stride); it != site.strides.end() )
+      it->second++;
+    else if( site.strides.size() < MaxStrides )
+      site.strides[stride] = 1;
+    else
+      site.other_strides++;
+  }
+
+  (store ? site.stores : site.loads)++;
+  site.last = addr;
+  site.size = size;
+
+  u64 first = addr / LineSize;
+  u64 last = (addr + size - 1) / LineSize;
+
+  if( first != last )
+    site.straddles++;
+
+  for( u64 line = first; line <= last; line++ ) {
+    auto& l = this->lines[line];
+
+    (store ? l.stores : l.loads)++;
+    this->window_lines.insert(line);
+  }
+
+  this->pages[addr / PageSize]++;
+  this->window_pages.insert(addr / PageSize);
+
+  if( ++this->count % Window == 0 ) {
+    this->working_set.push_back({ this->count, this->window_lines.size(), this->window_pages.size() });
+    this->window_lines.clear();
+    this->window_pages.clear();
+  }
+}
+
+void MemoryProfile::report(FILE* fp, size_t top) const {
+  auto working_set = this->working_set;
+
+  if( !this->window_lines.empty() )
+    working_set.push_back({ this->count, this->window_lines.size(), this->window_pages.size() });
+
+  fprintf(fp, "memory: %zu accesses  %zu lines  %zu pages\n",
+    this->count, this->lines.size(), this->pages.size());
+
+  // hot lines
+  std::vector<std::pair<u64, Line>> hot(this->lines.begin(), this->lines.end());
+
+  std::sort(hot.begin(), hot.end(), [] (auto& a, auto& b) {
+    return a.second.loads + a.second.stores > b.second.loads + b.second.stores;
+  });
+
+  for( size_t i = 0; i < std::min(top, hot.size()); i++ )
+    fprintf(fp, "memory: line 0x%zx  loads %zu  stores %zu\n",
+      hot[i].first * LineSize, hot[i].second.loads, hot[i].second.stores);
+
+  std::vector<std::pair<u64, u64>> hot_pages(this->pages.begin(), this->pages.end());
+
+  std::sort(hot_pages.begin(), hot_pages.end(), [] (auto& a, auto& b) {
+    return a.second > b.second;
+  });
+
+  for( size_t i = 0; i < std::min(top, hot_pages.size()); i++ )
+    fprintf(fp, "memory: page 0x%zx  accesses %zu\n", hot_pages[i].first * PageSize, hot_pages[i].second);
+
+  for( auto&& w : working_set )
+    fprintf(fp, "memory: working set at %zu  %zu lines ( %zu KiB )  %zu pages\n",
+      w.accesses, w.lines, w.lines * LineSize / 1024, w.pages);
+
+  /*
+   * each instruction, with advice:
+   *   straddles      -> align the data to the width of the access
+   *   stride > width -> a line brings in bytes never used
+   *   no main stride -> irregular ( pointer chasing, hashing )
+   */
+  std::vector<std::string> advice;
+
+  for( auto&& [pc, site] : this->sites ) {
+    u64 n = site.loads + site.stores;
+    i64 stride = 0;
+    u64 share = 0;
+
+    for( auto&& [s, c] : site.strides ) {
+      if( c > share ) {
+        stride = s;
+        share = c;
+      }
+    }
+
+    u64 pairs = n - 1;
+
+    fprintf(fp, "memory: pc %-6zu loads %-8zu stores %-8zu straddles %-6zu", pc, site.loads, site.stores, site.straddles);
+
+    if( pairs )
+      fprintf(fp, "  stride %+zd ( %zu%% )", stride, share * 100 / pairs);
+
+    fputc('\n', fp);
+
+    char buf[0x100];
+
+    if( site.straddles ) {
+      snprintf(buf, sizeof(buf), "pc %zu: %zu%% of accesses straddle a cache line, align the data to %zu bytes",
+        pc, site.straddles * 100 / n, site.size);
+      advice.emplace_back(buf);
+    }
+
+    if( pairs < 16 )
+      continue;
+
+    u64 abs = stride < 0 ? -stride : stride;
+
+    if( share * 2 < pairs ) {
+      snprintf(buf, sizeof(buf), "pc %zu: no regular stride, consider a contiguous layout for what it walks", pc);
+      advice.emplace_back(buf);
+    }
+    else if( abs > site.size && abs >= LineSize / 2 ) {
+      snprintf(buf, sizeof(buf), "pc %zu: stride %zu uses %zu of every %zu bytes loaded, "
+        "keep the fields it reads together ( struct of arrays )",
+        pc, abs, site.size, std::max(abs, LineSize));
+      advice.emplace_back(buf);
+    }
+  }
+
+  u64 peak_lines = 0, peak_pages = 0;
+
+  for( auto&& w : working_set ) {
+    peak_lines = std::max(peak_lines, w.lines);
+    peak_pages = std::max(peak_pages, w.pages);
+  }
+
+  if( peak_lines * LineSize > 32 * 1024 )
+    advice.emplace_back("working set of " + std::to_string(peak_lines * LineSize / 1024)
+      + " KiB exceeds a 32 KiB L1 data cache");
+
+  if( peak_pages > 64 )
+    advice.emplace_back("working set spans " + std::to_string(peak_pages)
+      + " pages, more than a 64-entry L1 TLB");
+
+  for( auto&& a : advice )
+    fprintf(fp, "advice: %s\n", a.c_str());
+}
+
+} // namespace metro::vm
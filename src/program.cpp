@@ -0,0 +1,54 @@
+#include "metro.h"
+
+namespace metro::vm {
+
+Program::Program(Image image)
+  : img(std::move(image))
+{
+}
+
+std::shared_ptr<Program const> Program::from_files(std::vector<std::string> const& paths,
+    bool optimize) {
+  std::vector<assembler::Object> objects;
+  Image image;
+
+  try {
+    for( auto&& path : paths ) {
+      auto& obj = objects.emplace_back();
+
+      if( path.ends_with(".mo") ) {
+        if( !assembler::read_object(obj, path) ) {
+          log_error("program: cannot read object '{}'", path);
+          return nullptr;
+        }
+      }
+      else
+        obj = assembler::assemble_object(path);
+    }
+
+    image = linker::link(objects);
+  }
+  catch( assembler::Error const& e ) {
+    log_error("program: {}", std::string_view(e.what()));
+    return nullptr;
+  }
+
+  if( optimize )
+    optimizer::default_pipeline().run(image);
+
+  log_debug("program: {} operations, {} bytes of data from {} files",
+    image.codes.size(), image.data.size(), paths.size());
+
+  return std::make_shared<Program const>(std::move(image));
+}
+
+std::optional<u64> Program::entry(std::string_view name) const {
+  auto it = this->img.entries.find(name);
+
+  if( it == this->img.entries.end() )
+    return std::nullopt;
+
+  return it->second;
+}
+
+} // namespace metro::vm
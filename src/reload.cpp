@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <set>
+#include <utility>
+#include "metro.h"
+
+namespace metro::vm {
+
+namespace {
+
+using Kind = Asm::Kind;
+
+/*
+ * functions of an image: from a global label to the next one.
+ * operations before the first label are a function named "".
+ */
+class Layout {
+public:
+  struct Function {
+    u64               begin;
+    u64               end;
+    std::string_view  name;
+  };
+
+  Image const& img;
+
+  explicit Layout(Image const& img)
+    : img(img)
+  {
+    for( auto&& [name, index] : img.entries )
+      this->starts.emplace_back(index, name);
+
+    if( this->starts.empty() || std::min_element(this->starts.begin(), this->starts.end())->first != 0 )
+      this->starts.emplace_back(0, "");
+
+    std::sort(this->starts.begin(), this->starts.end());
+  }
+
+  std::optional<Function> function_of(u64 index) const {
+    auto it = std::upper_bound(this->starts.begin(), this->starts.end(), index,
+      [] (u64 i, auto const& s) { return i < s.first; });
+
+    if( index >= this->img.codes.size() || it == this->starts.begin() )
+      return std::nullopt;
+
+    auto begin = std::prev(it);
+
+    return Function{ begin->first, it == this->starts.end() ? this->img.codes.size() : it->first, begin->second };
+  }
+
+  std::optional<u64> label(std::string_view name) const {
+    if( name.empty() )
+      return 0;
+
+    auto it = this->img.entries.find(name);
+
+    if( it == this->img.entries.end() )
+      return std::nullopt;
+
+    return it->second;
+  }
+
+  // name of the global label exactly at index
+  std::optional<std::string_view> name_at(u64 index) const {
+    auto fn = this->function_of(index);
+
+    if( fn && fn->begin == index )
+      return fn->name;
+
+    return std::nullopt;
+  }
+
+private:
+  std::vector<std::pair<u64, std::string_view>> starts;
+};
+
+/*
+ * code index of the old image => of the new image
+ */
+class CodeMap {
+  Layout from;
+  Layout to;
+
+  std::map<std::string_view, bool> unchanged_cache;
+
+public:
+  CodeMap(Image const& from, Image const& to)
+    : from(from),
+      to(to)
+  {
+  }
+
+  std::optional<u64> operator()(u64 index) {
+    if( index == (u64)-1 )
+      return index;
+
+    auto fn = this->from.function_of(index);
+
+    if( !fn )
+      return std::nullopt;
+
+    auto begin = this->to.label(fn->name);
+
+    if( !begin || (index != fn->begin && !this->unchanged(*fn)) )
+      return std::nullopt;
+
+    return *begin + (index - fn->begin);
+  }
+
+  // same operations in both images
+  bool unchanged(Layout::Function const& fn) {
+    if( auto it = this->unchanged_cache.find(fn.name); it != this->unchanged_cache.end() )
+      return it->second;
+
+    bool same = false;
+
+    if( auto begin = this->to.label(fn.name) ) {
+      auto other = this->to.function_of(*begin);
+
+      same = other && other->begin == *begin && other->end - other->begin == fn.end - fn.begin;
+
+      for( u64 i = 0; same && i < fn.end - fn.begin; i++ )
+        same = this->same_op(this->from.img.codes[fn.begin + i], fn, this->to.img.codes[*begin + i], *other);
+    }
+
+    return this->unchanged_cache[fn.name] = same;
+  }
+
+private:
+  bool same_op(Asm const& a, Layout::Function const& fa, Asm const& b, Layout::Function const& fb) const {
+    if( a.kind != b.kind || a.rd != b.rd || a.ra != b.ra || a.rb != b.rb
+        || a.with_value != b.with_value || a.data_type != b.data_type || a.str != b.str )
+      return false;
+
+    switch( a.kind ) {
+      // index of the site is numbered by the linker
+      case Kind::Jumpx:
+        return true;
+
+      // index of the name too ( .str is the name )
+      case Kind::SysCall:
+        return a.value < SysCallTable::ByName ? a.value == b.value : b.value >= SysCallTable::ByName;
+
+      case Kind::Call:
+      case Kind::Jump:
+        return this->same_target(a.value, fa, b.value, fb);
+
+      // code address ( .str is the label )
+      case Kind::Mov:
+        return !a.str.empty() || a.value == b.value;
+    }
+
+    return a.value == b.value;
+  }
+
+  // inside the function at the same offset, or the same global label
+  bool same_target(u64 a, Layout::Function const& fa, u64 b, Layout::Function const& fb) const {
+    if( a > fa.begin && a < fa.end )
+      return b > fb.begin && b < fb.end && a - fa.begin == b - fb.begin;
+
+    auto na = this->from.name_at(a);
+    auto nb = this->to.name_at(b);
+
+    return na && nb && *na == *nb;
+  }
+};
+
+// every data label of to is at the same offset in from
+bool same_data_layout(Image const& from, Image const& to) {
+  for( auto&& [name, offset] : to.data_labels ) {
+    auto it = from.data_labels.find(name);
+
+    if( it == from.data_labels.end() || it->second != offset )
+      return false;
+  }
+
+  return true;
+}
+
+/*
+ * code addresses made by "mov rN, <label>" can be anywhere in registers
+ * and memory. each label of from must be at the same index in to.
+ */
+bool same_taken_labels(Image const& from, Image const& to) {
+  auto taken = [] (Image const& img) {
+    std::set<std::pair<std::string_view, u64>> ret;
+
+    for( auto&& op : img.codes ) {
+      if( op.kind == Kind::Mov && !op.str.empty() )
+        ret.emplace(op.str, op.value);
+    }
+
+    return ret;
+  };
+
+  auto next = taken(to);
+
+  for( auto&& [name, index] : taken(from) ) {
+    auto e = to.entries.find(name);
+
+    if( !next.contains({ name, index }) && (e == to.entries.end() || e->second != index) )
+      return false;
+  }
+
+  return true;
+}
+
+} // namespace
+
+bool Machine::reload(std::shared_ptr<Program const> next) {
+  std::lock_guard lock{ this->reload_mtx };
+
+  if( this->root != this || !this->program )
+    return false;
+
+  auto& cur = this->program->image();
+  auto& img = next->image();
+
+  if( img.data.size() > this->data_size || !same_data_layout(cur, img) || !same_taken_labels(cur, img) )
+    return false;
+
+  // "sys <name>" is resolved when applied, within a run
+  for( auto&& name : img.sys_names ) {
+    if( !this->syscalls->find(name) )
+      return false;
+  }
+
+  this->next_program = std::move(next);
+  this->reload_requested.store(true, std::memory_order_relaxed);
+
+  return true;
+}
+
+bool Machine::apply_reload(std::vector<Asm> const& running) {
+  std::lock_guard lock{ this->reload_mtx };
+
+  if( !this->next_program || &running != &this->program->codes() )
+    return false;
+
+  // threads run the old codes
+  {
+    std::lock_guard lock{ this->thread_mtx };
+
+    if( !this->threads.empty() )
+      return false;
+  }
+
+  auto& next = this->next_program->image();
+  CodeMap map{ this->program->image(), next };
+
+  // checked by reload(), on_syscall can have rebound a name since
+  std::vector<u64> sys_numbers;
+
+  for( auto&& name : next.sys_names ) {
+    auto n = this->syscalls->find(name);
+
+    if( !n )
+      return false;
+
+    sys_numbers.push_back(*n);
+  }
+
+  // every frame must map
+  auto pc = map(cpu.pc);
+  u64 ret_stack[VCPU::ReturnStackDepth];
+
+  if( !pc )
+    return false;
+
+  for( u32 i = 0; i < cpu.ret_depth; i++ ) {
+    auto r = map(cpu.ret_stack[i]);
+
+    if( !r )
+      return false;
+
+    ret_stack[i] = *r;
+  }
+
+  // lr is not used by ret, cleared if its function changed
+  cpu.pc = *pc;
+  cpu.lr = map(cpu.lr).value_or((u64)-1);
+  std::copy(ret_stack, ret_stack + cpu.ret_depth, cpu.ret_stack);
+
+  log_info("reload: {} operations => {}, pc = {}",
+    this->program->codes().size(), next.codes.size(), cpu.pc);
+
+  this->retired = std::exchange(this->program, std::move(this->next_program));
+  this->codes = &this->program->codes();
+  this->reloads++;
+
+  // inline caches start empty, targets are of the old codes
+  this->jump_sites.assign(next.jump_sites, { });
+  this->jump_codes = this->codes;
+
+  this->sys_names = next.sys_names;
+  this->sys_numbers = std::move(sys_numbers);
+  this->reload_requested.store(false, std::memory_order_relaxed);
+
+  metrics::vm().reloads.add();
+
+  return true;
+}
+
+} // namespace metro::vm
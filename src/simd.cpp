@@ -0,0 +1,302 @@
+#include <algorithm>
+#include "metro.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+  #define METRO_SIMD_X86 1
+#else
+  #define METRO_SIMD_X86 0
+#endif
+
+namespace metro::simd {
+
+using vm::VReg;
+
+namespace {
+
+template <class T>
+T* lanes(VReg& v) {
+  if constexpr( sizeof(T) == 1 ) return v.b;
+  else if constexpr( sizeof(T) == 2 ) return v.h;
+  else if constexpr( sizeof(T) == 4 ) return v.w;
+  else return v.u;
+}
+
+template <class T>
+T const* lanes(VReg const& v) {
+  return lanes<T>(const_cast<VReg&>(v));
+}
+
+//
+// scalar
+//
+
+template <class T, class F>
+inline void binary(VReg& d, VReg const& a, VReg const& b, F f) {
+  for( size_t i = 0; i < sizeof(VReg) / sizeof(T); i++ )
+    lanes<T>(d)[i] = f(lanes<T>(a)[i], lanes<T>(b)[i]);
+}
+
+template <class T>
+void s_add(VReg& d, VReg const& a, VReg const& b) {
+  binary<T>(d, a, b, [] (T x, T y) -> T { return x + y; });
+}
+
+template <class T>
+void s_sub(VReg& d, VReg const& a, VReg const& b) {
+  binary<T>(d, a, b, [] (T x, T y) -> T { return x - y; });
+}
+
+// u8 / u16 would be promoted to int, and overflow it
+template <class T>
+void s_mul(VReg& d, VReg const& a, VReg const& b) {
+  using W = std::conditional_t<(sizeof(T) < sizeof(u32)), u32, T>;
+
+  binary<T>(d, a, b, [] (T x, T y) -> T { return (T)((W)x * y); });
+}
+
+template <class T>
+void s_cmpeq(VReg& d, VReg const& a, VReg const& b) {
+  binary<T>(d, a, b, [] (T x, T y) -> T { return x == y ? (T)~0 : 0; });
+}
+
+template <class T>
+void s_cmpgt(VReg& d, VReg const& a, VReg const& b) {
+  binary<T>(d, a, b, [] (T x, T y) -> T { return x > y ? (T)~0 : 0; });
+}
+
+void s_and(VReg& d, VReg const& a, VReg const& b) {
+  binary<u64>(d, a, b, [] (u64 x, u64 y) -> u64 { return x & y; });
+}
+
+template <class T>
+u64 s_sum(VReg const& a) {
+  u64 ret = 0;
+
+  for( size_t i = 0; i < sizeof(VReg) / sizeof(T); i++ )
+    ret += lanes<T>(a)[i];
+
+  return ret;
+}
+
+template <class T>
+u64 s_max(VReg const& a) {
+  T ret = 0;
+
+  for( size_t i = 0; i < sizeof(VReg) / sizeof(T); i++ )
+    ret = std::max(ret, lanes<T>(a)[i]);
+
+  return ret;
+}
+
+#define SCALAR_ALL(f)   { f<u8>, f<u16>, f<u32>, f<u64> }
+
+Kernels const scalar_kernels = {
+  .backend  = Backend::Scalar,
+  .add      = SCALAR_ALL(s_add),
+  .sub      = SCALAR_ALL(s_sub),
+  .mul      = SCALAR_ALL(s_mul),
+  .cmpeq    = SCALAR_ALL(s_cmpeq),
+  .cmpgt    = SCALAR_ALL(s_cmpgt),
+  .band     = s_and,
+  .sum      = SCALAR_ALL(s_sum),
+  .max      = SCALAR_ALL(s_max),
+};
+
+#if METRO_SIMD_X86
+
+//
+// SSE2 (two halves of 128bit)
+//
+
+#define SSE2_BINARY(name, expr) \
+  void name(VReg& d, VReg const& a, VReg const& b) { \
+    for( int i = 0; i < 2; i++ ) { \
+      __m128i x = _mm_load_si128((__m128i const*)a.b + i); \
+      __m128i y = _mm_load_si128((__m128i const*)b.b + i); \
+      _mm_store_si128((__m128i*)d.b + i, expr); \
+    } \
+  }
+
+// unsigned compare by flipping the sign bit
+#define SSE2_CMPGT_U(bits, one) \
+  _mm_cmpgt_epi##bits(_mm_xor_si128(x, _mm_set1_epi##bits(one)), \
+                      _mm_xor_si128(y, _mm_set1_epi##bits(one)))
+
+SSE2_BINARY(sse2_add8,  _mm_add_epi8(x, y))
+SSE2_BINARY(sse2_add16, _mm_add_epi16(x, y))
+SSE2_BINARY(sse2_add32, _mm_add_epi32(x, y))
+SSE2_BINARY(sse2_add64, _mm_add_epi64(x, y))
+
+SSE2_BINARY(sse2_sub8,  _mm_sub_epi8(x, y))
+SSE2_BINARY(sse2_sub16, _mm_sub_epi16(x, y))
+SSE2_BINARY(sse2_sub32, _mm_sub_epi32(x, y))
+SSE2_BINARY(sse2_sub64, _mm_sub_epi64(x, y))
+
+SSE2_BINARY(sse2_mul16, _mm_mullo_epi16(x, y))
+
+SSE2_BINARY(sse2_cmpeq8,  _mm_cmpeq_epi8(x, y))
+SSE2_BINARY(sse2_cmpeq16, _mm_cmpeq_epi16(x, y))
+SSE2_BINARY(sse2_cmpeq32, _mm_cmpeq_epi32(x, y))
+
+SSE2_BINARY(sse2_cmpgt8,  SSE2_CMPGT_U(8, (char)0x80))
+SSE2_BINARY(sse2_cmpgt16, SSE2_CMPGT_U(16, (short)0x8000))
+SSE2_BINARY(sse2_cmpgt32, SSE2_CMPGT_U(32, (int)0x80000000))
+
+SSE2_BINARY(sse2_and, _mm_and_si128(x, y))
+
+u64 sse2_sum8(VReg const& a) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i s = _mm_add_epi64(
+    _mm_sad_epu8(_mm_load_si128((__m128i const*)a.b), zero),
+    _mm_sad_epu8(_mm_load_si128((__m128i const*)a.b + 1), zero));
+
+  return (u64)_mm_cvtsi128_si64(s) + (u64)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+}
+
+u64 sse2_max8(VReg const& a) {
+  __m128i m = _mm_max_epu8(_mm_load_si128((__m128i const*)a.b),
+                           _mm_load_si128((__m128i const*)a.b + 1));
+
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+
+  return (u8)_mm_cvtsi128_si32(m);
+}
+
+// no SSE2 instruction for the others
+Kernels const sse2_kernels = {
+  .backend  = Backend::SSE2,
+  .add      = { sse2_add8, sse2_add16, sse2_add32, sse2_add64 },
+  .sub      = { sse2_sub8, sse2_sub16, sse2_sub32, sse2_sub64 },
+  .mul      = { s_mul<u8>, sse2_mul16, s_mul<u32>, s_mul<u64> },
+  .cmpeq    = { sse2_cmpeq8, sse2_cmpeq16, sse2_cmpeq32, s_cmpeq<u64> },
+  .cmpgt    = { sse2_cmpgt8, sse2_cmpgt16, sse2_cmpgt32, s_cmpgt<u64> },
+  .band     = sse2_and,
+  .sum      = { sse2_sum8, s_sum<u16>, s_sum<u32>, s_sum<u64> },
+  .max      = { sse2_max8, s_max<u16>, s_max<u32>, s_max<u64> },
+};
+
+//
+// AVX2
+//
+
+#define AVX2_BINARY(name, expr) \
+  __attribute__((target("avx2"))) \
+  void name(VReg& d, VReg const& a, VReg const& b) { \
+    __m256i x = _mm256_load_si256((__m256i const*)a.b); \
+    __m256i y = _mm256_load_si256((__m256i const*)b.b); \
+    _mm256_store_si256((__m256i*)d.b, expr); \
+  }
+
+#define AVX2_CMPGT_U(bits, one) \
+  _mm256_cmpgt_epi##bits(_mm256_xor_si256(x, _mm256_set1_epi##bits(one)), \
+                         _mm256_xor_si256(y, _mm256_set1_epi##bits(one)))
+
+AVX2_BINARY(avx2_add8,  _mm256_add_epi8(x, y))
+AVX2_BINARY(avx2_add16, _mm256_add_epi16(x, y))
+AVX2_BINARY(avx2_add32, _mm256_add_epi32(x, y))
+AVX2_BINARY(avx2_add64, _mm256_add_epi64(x, y))
+
+AVX2_BINARY(avx2_sub8,  _mm256_sub_epi8(x, y))
+AVX2_BINARY(avx2_sub16, _mm256_sub_epi16(x, y))
+AVX2_BINARY(avx2_sub32, _mm256_sub_epi32(x, y))
+AVX2_BINARY(avx2_sub64, _mm256_sub_epi64(x, y))
+
+AVX2_BINARY(avx2_mul16, _mm256_mullo_epi16(x, y))
+AVX2_BINARY(avx2_mul32, _mm256_mullo_epi32(x, y))
+
+AVX2_BINARY(avx2_cmpeq8,  _mm256_cmpeq_epi8(x, y))
+AVX2_BINARY(avx2_cmpeq16, _mm256_cmpeq_epi16(x, y))
+AVX2_BINARY(avx2_cmpeq32, _mm256_cmpeq_epi32(x, y))
+AVX2_BINARY(avx2_cmpeq64, _mm256_cmpeq_epi64(x, y))
+
+AVX2_BINARY(avx2_cmpgt8,  AVX2_CMPGT_U(8, (char)0x80))
+AVX2_BINARY(avx2_cmpgt16, AVX2_CMPGT_U(16, (short)0x8000))
+AVX2_BINARY(avx2_cmpgt32, AVX2_CMPGT_U(32, (int)0x80000000))
+AVX2_BINARY(avx2_cmpgt64,
+  _mm256_cmpgt_epi64(_mm256_xor_si256(x, _mm256_set1_epi64x((long long)0x8000000000000000)),
+                     _mm256_xor_si256(y, _mm256_set1_epi64x((long long)0x8000000000000000))))
+
+AVX2_BINARY(avx2_and, _mm256_and_si256(x, y))
+
+__attribute__((target("avx2")))
+u64 avx2_sum8(VReg const& a) {
+  __m256i s = _mm256_sad_epu8(_mm256_load_si256((__m256i const*)a.b), _mm256_setzero_si256());
+
+  return (u64)_mm256_extract_epi64(s, 0) + (u64)_mm256_extract_epi64(s, 1)
+       + (u64)_mm256_extract_epi64(s, 2) + (u64)_mm256_extract_epi64(s, 3);
+}
+
+__attribute__((target("avx2")))
+u64 avx2_max8(VReg const& a) {
+  __m256i v = _mm256_load_si256((__m256i const*)a.b);
+  __m128i m = _mm_max_epu8(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+
+  return (u8)_mm_cvtsi128_si32(m);
+}
+
+Kernels const avx2_kernels = {
+  .backend  = Backend::AVX2,
+  .add      = { avx2_add8, avx2_add16, avx2_add32, avx2_add64 },
+  .sub      = { avx2_sub8, avx2_sub16, avx2_sub32, avx2_sub64 },
+  .mul      = { s_mul<u8>, avx2_mul16, avx2_mul32, s_mul<u64> },
+  .cmpeq    = { avx2_cmpeq8, avx2_cmpeq16, avx2_cmpeq32, avx2_cmpeq64 },
+  .cmpgt    = { avx2_cmpgt8, avx2_cmpgt16, avx2_cmpgt32, avx2_cmpgt64 },
+  .band     = avx2_and,
+  .sum      = { avx2_sum8, s_sum<u16>, s_sum<u32>, s_sum<u64> },
+  .max      = { avx2_max8, s_max<u16>, s_max<u32>, s_max<u64> },
+};
+
+#endif
+
+} // namespace
+
+Kernels const* kernels(Backend backend) {
+  switch( backend ) {
+    case Backend::Scalar:
+      return &scalar_kernels;
+
+#if METRO_SIMD_X86
+    case Backend::SSE2:
+      return &sse2_kernels;
+
+    case Backend::AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") ? &avx2_kernels : nullptr;
+#endif
+  }
+
+  return nullptr;
+}
+
+Kernels const& kernels() {
+  static Kernels const& best = [] () -> Kernels const& {
+    for( auto b : { Backend::AVX2, Backend::SSE2 } )
+      if( auto k = kernels(b); k )
+        return *k;
+
+    return scalar_kernels;
+  }();
+
+  return best;
+}
+
+char const* backend_name(Backend backend) {
+  switch( backend ) {
+    case Backend::Scalar: return "scalar";
+    case Backend::SSE2:   return "sse2";
+    case Backend::AVX2:   return "avx2";
+  }
+
+  return "?";
+}
+
+} // namespace metro::simd
@@ -0,0 +1,313 @@
+#include <fstream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "metro.h"
+
+/*
+ * snapshot file (*.msnap)
+ *
+ *  header:
+ *    "MSNP"  u32 version
+ *
+ *  u64 memory_size   u64 data_size
+ *  u64 registers[16]   vregs[16] (32 bytes each)   u32 cmp_result
+ *  u32 ret_depth   u64 ret_stack[ret_depth]
+ *
+ *  heap:
+ *    u64 top   u64 arena   u64 free_list[Heap::ClassCount]
+ *    u64 count, large_free[count]
+ *      u64 size   u64 offset
+ *    u64 count, pages[count]         ( count = top / Heap::PageSize )
+ *      u32 cls   u32 run   u32 pages
+ *    Heap::Stats (u64 each)
+ *
+ *  u64 count, ranges[count]
+ *    u64 offset   u64 size   u8 bytes[size]
+ *
+ *  all integers are little endian
+ */
+
+namespace metro::vm {
+
+static constexpr char Magic[4] = { 'M', 'S', 'N', 'P' };
+static constexpr u32 Version = 3;
+
+namespace {
+
+int create_memfd(size_t size) {
+  int fd = memfd_create("metro-snapshot", MFD_CLOEXEC);
+
+  if( fd < 0 )
+    return -1;
+
+  if( ftruncate(fd, size) < 0 ) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool pwrite_all(int fd, u8 const* p, size_t size, u64 offset) {
+  while( size ) {
+    ssize_t n = pwrite(fd, p, size, offset);
+
+    if( n <= 0 )
+      return false;
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+bool pread_all(int fd, u8* p, size_t size, u64 offset) {
+  while( size ) {
+    ssize_t n = pread(fd, p, size, offset);
+
+    if( n <= 0 )
+      return false;
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+size_t data_area_of(size_t data_size) {
+  return (data_size + Machine::DataAlign - 1) & ~(Machine::DataAlign - 1);
+}
+
+} // namespace
+
+Machine::Snapshot::~Snapshot()
+{
+  if( this->fd >= 0 )
+    close(this->fd);
+}
+
+std::shared_ptr<Machine::Snapshot const> Machine::snapshot() {
+  if( this->mode != MemoryMode::Guest ) {
+    log_error("snapshot: needs Guest memory mode");
+    return nullptr;
+  }
+
+  if( this->root != this || !this->threads.empty() ) {
+    log_error("snapshot: machine has threads");
+    return nullptr;
+  }
+
+  auto snap = std::make_shared<Snapshot>();
+  size_t data_area = data_area_of(this->data_size);
+
+  snap->cpu = this->cpu;
+  snap->cmp_result = this->cmp_result;
+  snap->memory_size = this->memory_size;
+  snap->data_size = this->data_size;
+  snap->heap = this->heap->save();
+
+  // data + general heap, arena + stack
+  snap->ranges = {
+    { 0, data_area + snap->heap.top },
+    { data_area + snap->heap.arena, this->memory_size - data_area - snap->heap.arena },
+  };
+
+  if( (snap->fd = create_memfd(this->memory_size)) < 0 ) {
+    log_error("snapshot: cannot create memfd");
+    return nullptr;
+  }
+
+  for( auto&& [offs, size] : snap->ranges ) {
+    if( !pwrite_all(snap->fd, this->memory + offs, size, offs) ) {
+      log_error("snapshot: cannot write memfd");
+      return nullptr;
+    }
+  }
+
+  return snap;
+}
+
+Machine::Machine(Snapshot const& snap)
+  : cmp_result(snap.cmp_result),
+    mode(MemoryMode::Guest),
+    memory(nullptr),
+    memory_size(snap.memory_size)
+{
+  // pages are read from the snapshot until written
+  auto p = mmap(nullptr, snap.memory_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_NORESERVE, snap.fd, 0);
+
+  if( p == MAP_FAILED )
+    panic("cannot map snapshot");
+
+  this->memory = (u8*)p;
+  this->set_layout(snap.data_size);
+
+  this->heap->restore((u8*)this->stack - HeapSize, HeapSize, snap.heap);
+
+  this->cpu = snap.cpu;
+  this->select_policy();
+}
+
+bool write_snapshot(std::string const& path, Machine::Snapshot const& snap) {
+  std::ofstream ofs{ path, std::ios::binary };
+
+  if( ofs.fail() )
+    return false;
+
+  auto put = [&] <class T> (T const& v) {
+    ofs.write((char const*)&v, sizeof(T));
+  };
+
+  ofs.write(Magic, 4);
+  put((u32)Version);
+
+  put((u64)snap.memory_size);
+  put((u64)snap.data_size);
+  put(snap.cpu.registers);
+  put(snap.cpu.vregs);
+  put((u32)snap.cmp_result);
+  put(snap.cpu.ret_depth);
+  ofs.write((char const*)snap.cpu.ret_stack, snap.cpu.ret_depth * sizeof(u64));
+
+  put(snap.heap.top);
+  put(snap.heap.arena);
+  put(snap.heap.free_list);
+  put((u64)snap.heap.large_free.size());
+
+  for( auto&& [size, offs] : snap.heap.large_free ) {
+    put(size);
+    put(offs);
+  }
+
+  put((u64)snap.heap.pages.size());
+  ofs.write((char const*)snap.heap.pages.data(), snap.heap.pages.size() * sizeof(Heap::Page));
+
+  put(snap.heap.stats);
+
+  put((u64)snap.ranges.size());
+
+  std::vector<u8> buf;
+
+  for( auto&& [offs, size] : snap.ranges ) {
+    buf.resize(size);
+
+    if( !pread_all(snap.fd, buf.data(), size, offs) )
+      return false;
+
+    put(offs);
+    put(size);
+    ofs.write((char const*)buf.data(), size);
+  }
+
+  return !ofs.fail();
+}
+
+bool read_snapshot(std::shared_ptr<Machine::Snapshot const>& out, std::string const& path) {
+  std::ifstream ifs{ path, std::ios::binary };
+
+  if( ifs.fail() )
+    return false;
+
+  auto get = [&] <class T> (T& v) {
+    return (bool)ifs.read((char*)&v, sizeof(T));
+  };
+
+  char magic[4];
+  u32 version = 0, cmp = 0;
+  u64 memory_size = 0, data_size = 0, count = 0;
+
+  if( !get(magic) || memcmp(magic, Magic, 4) || !get(version) || version != Version )
+    return false;
+
+  auto snap = std::make_shared<Machine::Snapshot>();
+
+  if( !get(memory_size) || !get(data_size) || !get(snap->cpu.registers)
+      || !get(snap->cpu.vregs) || !get(cmp) || !get(snap->cpu.ret_depth)
+      || snap->cpu.ret_depth > VCPU::ReturnStackDepth
+      || !ifs.read((char*)snap->cpu.ret_stack, snap->cpu.ret_depth * sizeof(u64)) )
+    return false;
+
+  size_t data_area = data_area_of(data_size);
+
+  // layout must be the one of this build
+  if( data_size > memory_size
+      || memory_size != data_area + Machine::HeapSize + Machine::StackSize )
+    return false;
+
+  auto& heap = snap->heap;
+
+  if( !get(heap.top) || !get(heap.arena) || !get(heap.free_list) || !get(count)
+      || heap.top > heap.arena || heap.arena > Machine::HeapSize || count > Machine::HeapSize )
+    return false;
+
+  for( auto&& offs : heap.free_list ) {
+    if( offs > heap.top )
+      return false;
+  }
+
+  for( u64 i = 0; i < count; i++ ) {
+    u64 size, offs;
+
+    if( !get(size) || !get(offs) || size > heap.top || offs > heap.top - size
+        || size % Heap::PageSize || offs % Heap::PageSize )
+      return false;
+
+    heap.large_free.emplace_back(size, offs);
+  }
+
+  // owners of pages, every run inside [0, top)
+  if( !get(count) || heap.top % Heap::PageSize || count != heap.top / Heap::PageSize )
+    return false;
+
+  heap.pages.resize(count);
+
+  if( !ifs.read((char*)heap.pages.data(), count * sizeof(Heap::Page)) )
+    return false;
+
+  for( u64 i = 0; i < count; i++ ) {
+    auto& pg = heap.pages[i];
+
+    if( pg.cls > Heap::ClassCount || pg.run > i || pg.pages == 0 || i - pg.run >= pg.pages
+        || pg.pages > count - pg.run )
+      return false;
+  }
+
+  if( !get(heap.stats) || !get(count) || count > memory_size )
+    return false;
+
+  snap->cmp_result = static_cast<decltype(snap->cmp_result)>(cmp);
+  snap->memory_size = memory_size;
+  snap->data_size = data_size;
+
+  if( (snap->fd = create_memfd(memory_size)) < 0 )
+    return false;
+
+  std::vector<u8> buf;
+
+  for( u64 i = 0; i < count; i++ ) {
+    u64 offs, size;
+
+    if( !get(offs) || !get(size) || size > memory_size || offs > memory_size - size )
+      return false;
+
+    buf.resize(size);
+
+    if( !ifs.read((char*)buf.data(), size) || !pwrite_all(snap->fd, buf.data(), size, offs) )
+      return false;
+
+    snap->ranges.emplace_back(offs, size);
+  }
+
+  if( ifs.peek() != EOF )
+    return false;
+
+  out = std::move(snap);
+  return true;
+}
+
+} // namespace metro::vm
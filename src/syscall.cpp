@@ -0,0 +1,286 @@
+#include <bit>
+#include <atomic>
+#include "metro.h"
+
+namespace metro::vm {
+
+namespace {
+
+using atomic_u64 = std::atomic_ref<u64>;
+
+/*
+ * tables alive, and the counts of destroyed ones.
+ * bind() holds mtx too, totals() may read any table while it runs.
+ */
+struct Tables {
+  std::mutex                                                  mtx;
+  std::unordered_set<SysCallTable const*>                     live;
+  std::map<std::pair<u64, std::string>, SysCallTable::Total>  retired;
+};
+
+// never destroyed, tables can be destroyed during exit
+Tables& tables() {
+  static Tables* const t = new Tables;
+
+  return *t;
+}
+
+// mtx is held
+void add_counts(std::map<std::pair<u64, std::string>, SysCallTable::Total>& out,
+    SysCallTable const& table) {
+  auto const& all = table.all();
+
+  for( u64 n = 0; n < all.size(); n++ ) {
+    auto& e = all[n];
+    u64 calls = atomic_u64(e.calls).load(std::memory_order_relaxed);
+
+    if( !calls )
+      continue;
+
+    auto& t = out[{ n, e.name }];
+
+    t.number = n;
+    t.name = e.name;
+    t.calls += calls;
+    t.total_ns += atomic_u64(e.total_ns).load(std::memory_order_relaxed);
+
+    for( size_t b = 0; b < SysCallTable::HistogramBuckets; b++ )
+      t.histogram[b] += atomic_u64(e.histogram[b]).load(std::memory_order_relaxed);
+  }
+}
+
+/*
+ * system calls of the VM ( see syscall.md )
+ */
+std::shared_ptr<SysCallTable> make_builtin() {
+  auto t = std::make_shared<SysCallTable>();
+
+  t->bind_typed(0, "putc", [] (u64 c) {
+    printf("%c", (char)c);
+  });
+
+  /*
+   * bulk memory
+   *
+   * libc's mem* functions are the host kernels. (glibc selects
+   * AVX2 / EVEX versions for the CPU at load time)
+   * in Guest mode whole ranges are checked once, before the copy.
+   */
+
+  // overlap allowed
+  t->bind_typed(1, "memcpy", [] (Machine& m, u64 dest, u64 src, u64 len) {
+    memmove(m.host_ptr(dest, len), m.host_ptr(src, len), len);
+  });
+
+  t->bind_typed(2, "memset", [] (Machine& m, u64 dest, u64 byte, u64 len) {
+    memset(m.host_ptr(dest, len), (int)(u8)byte, len);
+  });
+
+  t->bind_typed(3, "memcmp", [] (Machine& m, u64 a, u64 b, u64 len) {
+    int r = memcmp(m.host_ptr(a, len), m.host_ptr(b, len), len);
+
+    return (i64)((r > 0) - (r < 0));
+  });
+
+  t->bind_typed(4, "memchr", [] (Machine& m, u64 addr, u64 byte, u64 len) {
+    auto p = (u8 const*)memchr(m.host_ptr(addr, len), (int)(u8)byte, len);
+
+    return p ? m.guest_addr(p) : 0;
+  });
+
+  /*
+   * heap
+   *
+   * returned address is 0 when out of memory.
+   * freeing an address not allocated ( or already freed ) is a fault.
+   */
+
+  t->bind_typed(5, "alloc", [] (Machine& m, u64 size) {
+    auto p = (u8*)m.heap_cache.alloc(size);
+
+    return p ? m.guest_addr(p) : 0;
+  });
+
+  t->bind_typed(6, "free", [] (Machine& m, u64 addr) {
+    if( addr )
+      m.heap_cache.free(m.heap_ptr(addr));
+  });
+
+  t->bind_typed(7, "realloc", [] (Machine& m, u64 addr, u64 size) {
+    auto p = (u8*)m.heap_cache.realloc(addr ? m.heap_ptr(addr) : nullptr, size);
+
+    return p ? m.guest_addr(p) : 0;
+  });
+
+  t->bind_typed(8, "arena_alloc", [] (Machine& m, u64 size) {
+    auto p = (u8*)m.heap->arena_alloc(size);
+
+    return p ? m.guest_addr(p) : 0;
+  });
+
+  t->bind_typed(9, "arena_reset", [] (Machine& m) {
+    m.heap->arena_reset();
+  });
+
+  // thread
+  t->bind_typed(10, "spawn", [] (Machine& m, u64 entry, u64 arg) {
+    return m.spawn(*m.codes, entry, arg);
+  });
+
+  t->bind_typed(11, "join", [] (Machine& m, u64 id) {
+    return m.join(id);
+  });
+
+  /*
+   * channel
+   *
+   * message is copied between the slot and guest memory directly.
+   * in a run with a budget, send / recv wait only WaitRounds and then
+   * retry the sys after the budget check ( see Machine::retry ).
+   */
+  static constexpr u32 WaitRounds = 256;
+
+  t->bind_typed(12, "send", [] (Machine& m, u64 index, u64 addr) {
+    auto& ch = m.channel(index);
+    auto msg = m.host_ptr(addr, ch.message_size());
+
+    if( !m.budget || !m.budget->limited() )
+      ch.send(msg);
+    else if( !ch.send_for(msg, WaitRounds) )
+      m.retry = true;
+  });
+
+  t->bind_typed(13, "recv", [] (Machine& m, u64 index, u64 addr) {
+    auto& ch = m.channel(index);
+    auto msg = m.host_ptr(addr, ch.message_size());
+
+    if( !m.budget || !m.budget->limited() )
+      ch.recv(msg);
+    else if( !ch.recv_for(msg, WaitRounds) )
+      m.retry = true;
+  });
+
+  t->bind_typed(14, "try_recv", [] (Machine& m, u64 index, u64 addr) {
+    auto& ch = m.channel(index);
+
+    return (u64)ch.try_recv(m.host_ptr(addr, ch.message_size()));
+  });
+
+  t->bind_typed(15, "try_send", [] (Machine& m, u64 index, u64 addr) {
+    auto& ch = m.channel(index);
+
+    return (u64)ch.try_send(m.host_ptr(addr, ch.message_size()));
+  });
+
+  return t;
+}
+
+} // namespace
+
+SysCallTable::SysCallTable() {
+  auto& T = tables();
+  std::lock_guard lock{ T.mtx };
+
+  T.live.insert(this);
+}
+
+SysCallTable::SysCallTable(SysCallTable const& other)
+  : SysCallTable()
+{
+  std::lock_guard lock{ tables().mtx };
+
+  this->names = other.names;
+  this->entries.resize(other.entries.size());
+
+  for( size_t i = 0; i < other.entries.size(); i++ ) {
+    this->entries[i].name = other.entries[i].name;
+    this->entries[i].fn = other.entries[i].fn;
+  }
+}
+
+SysCallTable::~SysCallTable() {
+  auto& T = tables();
+  std::lock_guard lock{ T.mtx };
+
+  add_counts(T.retired, *this);
+  T.live.erase(this);
+}
+
+std::vector<SysCallTable::Total> SysCallTable::totals() {
+  auto& T = tables();
+  std::lock_guard lock{ T.mtx };
+
+  auto sum = T.retired;
+
+  for( auto t : T.live )
+    add_counts(sum, *t);
+
+  std::vector<Total> ret;
+
+  for( auto&& [_, t] : sum )
+    ret.push_back(std::move(t));
+
+  return ret;
+}
+
+std::shared_ptr<SysCallTable const> const& SysCallTable::global() {
+  static std::shared_ptr<SysCallTable const> const table = make_builtin();
+
+  return table;
+}
+
+void SysCallTable::bind(u64 number, std::string name, Handler fn) {
+  if( number >= MaxSysCalls )
+    panic("system call number too large: " << number);
+
+  if( !name.empty() ) {
+    if( auto n = this->find(name); n && *n != number )
+      panic("system call '" << name << "' is already bound to " << *n);
+  }
+
+  std::lock_guard lock{ tables().mtx };
+
+  if( number >= this->entries.size() )
+    this->entries.resize(number + 1);
+
+  auto& e = this->entries[number];
+
+  if( !e.name.empty() )
+    this->names.erase(e.name);
+
+  if( !name.empty() )
+    this->names[name] = number;
+
+  e = { };
+  e.name = std::move(name);
+  e.fn = std::move(fn);
+}
+
+std::optional<u64> SysCallTable::find(std::string_view name) const {
+  if( auto it = this->names.find(name); it != this->names.end() )
+    return it->second;
+
+  return std::nullopt;
+}
+
+void SysCallTable::call(u64 number, Machine& m) const {
+  using Clock = std::chrono::steady_clock;
+
+  if( number >= this->entries.size() || !this->entries[number].fn )
+    m.fault("unknown system call " + std::to_string(number));
+
+  auto& e = this->entries[number];
+  auto begin = Clock::now();
+
+  e.fn(m);
+
+  u64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+  size_t bucket = std::min<size_t>(ns ? std::bit_width(ns) - 1 : 0, HistogramBuckets - 1);
+
+  // machines on other threads may share the table
+  atomic_u64(e.calls).fetch_add(1, std::memory_order_relaxed);
+  atomic_u64(e.total_ns).fetch_add(ns, std::memory_order_relaxed);
+  atomic_u64(e.histogram[bucket]).fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace metro::vm
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include "metro.h"
+
+namespace metro::vm {
+
+Machine::Machine(Machine& root, u8* stack)
+  : cmp_result(None),
+    kernels(root.kernels),
+    program(root.program),
+    root(&root),
+    mode(root.mode),
+    memory(root.memory),
+    memory_size(root.memory_size),
+    memory_base(root.memory_base),
+    data(root.data),
+    data_size(root.data_size),
+    stack((u64*)stack),
+    heap(root.heap)
+{
+  this->select_policy();
+}
+
+/*
+ * start a thread at codes[entry] with r0 = arg.
+ * returns id of the thread, or 0 if no memory for the stack.
+ */
+u64 Machine::spawn(std::vector<Asm> const& codes, u64 entry, u64 arg) {
+  if( entry >= codes.size() )
+    this->fault("spawn: entry out of code: " + std::to_string(entry));
+
+  auto stack = (u8*)this->heap_cache.alloc(StackSize);
+
+  if( !stack ) {
+    log_warn("spawn: no memory for a stack, pc = {}", cpu.pc);
+    return 0;
+  }
+
+  auto m = std::make_unique<Machine>(*this->root, stack);
+
+  m->start(entry);
+  m->cpu.registers[0] = arg;
+  m->sys_names = this->sys_names;
+  m->sys_numbers = this->sys_numbers;
+
+  // limits of this run, and the root can stop it
+  Budget budget = this->budget ? *this->budget : Budget{ };
+
+  budget.stop = &this->root->stopping;
+
+  std::lock_guard lock{ this->root->thread_mtx };
+
+  u64 id = this->root->next_thread_id++;
+  auto& th = this->root->threads[id];
+
+  m->thread_id = id;
+
+  th.machine = std::move(m);
+  th.thread = std::thread([&codes, budget, t = &th] {
+    t->status = t->machine->run(codes, budget);
+  });
+
+  log_debug("spawn: thread {} at {}, arg = {}", id, entry, arg);
+
+  return id;
+}
+
+/*
+ * wait for the thread and release it.
+ * returns r0 of the thread at exit.
+ */
+u64 Machine::join(u64 id) {
+  auto root = this->root;
+  Thread* th;
+
+  {
+    std::lock_guard lock{ root->thread_mtx };
+    auto it = root->threads.find(id);
+
+    if( id == this->thread_id )
+      this->fault("join: thread " + std::to_string(id) + " joins itself");
+
+    if( it == root->threads.end() )
+      this->fault("join: no thread " + std::to_string(id));
+
+    if( it->second.joined )
+      this->fault("join: thread " + std::to_string(id) + " is already being joined");
+
+    // a cycle of joins would wait forever
+    for( u64 w = it->second.machine->joining; w; ) {
+      if( w == this->thread_id )
+        this->fault("join: thread " + std::to_string(id) + " is joining this thread");
+
+      auto next = root->threads.find(w);
+      w = next != root->threads.end() ? next->second.machine->joining : 0;
+    }
+
+    th = &it->second;
+    th->joined = true;
+    this->joining = id;
+  }
+
+  th->thread.join();
+
+  auto status = th->status;
+  u64 r0 = th->machine->cpu.registers[0];
+  std::string reason = th->machine->last_fault;
+
+  log_debug("join: thread {}, r0 = {}", id, r0);
+
+  this->heap_cache.free(th->machine->stack);
+
+  {
+    std::lock_guard lock{ root->thread_mtx };
+
+    root->threads.erase(id);
+    this->joining = 0;
+  }
+
+  switch( status ) {
+    case RunStatus::Fault:
+      this->fault("join: thread " + std::to_string(id) + " faulted: " + reason);
+
+    case RunStatus::OutOfFuel:
+    case RunStatus::Deadline:
+      this->fault("join: thread " + std::to_string(id) + " did not halt within the budget");
+  }
+
+  return r0;
+}
+
+// the threads are stopped ( root->stopping ) or halting
+void Machine::join_all() {
+  while( true ) {
+    Thread* th;
+    u64 id;
+
+    {
+      std::lock_guard lock{ this->thread_mtx };
+
+      if( this->threads.empty() )
+        return;
+
+      // not joined by another thread ( which is here too, joins do not cycle )
+      auto it = std::find_if(this->threads.begin(), this->threads.end(),
+        [] (auto& t) { return !t.second.joined; });
+
+      if( it == this->threads.end() ) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      id = it->first;
+      th = &it->second;
+      th->joined = true;
+    }
+
+    th->thread.join();
+    this->heap_cache.free(th->machine->stack);
+
+    std::lock_guard lock{ this->thread_mtx };
+    this->threads.erase(id);
+  }
+}
+
+u64& Machine::atomic_word(u64 addr) {
+  if( addr % alignof(u64) )
+    this->fault(addr, sizeof(u64));
+
+  return *(u64*)this->host_ptr(addr, sizeof(u64));
+}
+
+} // namespace metro::vm
@@ -0,0 +1,201 @@
+#include <cstring>
+#include "metro.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+  #define METRO_UTF_X86 1
+#else
+  #define METRO_UTF_X86 0
+#endif
+
+namespace metro::utf {
+
+/*
+ * decode one code point starting at in[i] and write it as UTF-16 to out[o].
+ *
+ * returns false if the sequence is invalid (overlong, surrogate,
+ * out of range, or truncated).
+ */
+static inline bool decode_one(u8 const* in, size_t len, size_t& i,
+                              char16_t* out, size_t& o) {
+  u8 c = in[i];
+  u32 cp;
+  size_t n;
+
+  if( (c & 0xE0) == 0xC0 ) { cp = c & 0x1F; n = 2; }
+  else if( (c & 0xF0) == 0xE0 ) { cp = c & 0x0F; n = 3; }
+  else if( (c & 0xF8) == 0xF0 ) { cp = c & 0x07; n = 4; }
+  else if( c < 0x80 ) { cp = c; n = 1; }
+  else
+    return false;
+
+  if( i + n > len )
+    return false;
+
+  for( size_t k = 1; k < n; k++ ) {
+    if( (in[i + k] & 0xC0) != 0x80 )
+      return false;
+
+    cp = (cp << 6) | (in[i + k] & 0x3F);
+  }
+
+  static constexpr u32 min_of_len[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+  if( cp < min_of_len[n] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF) )
+    return false;
+
+  if( cp >= 0x10000 ) {
+    cp -= 0x10000;
+    out[o++] = static_cast<char16_t>(0xD800 | (cp >> 10));
+    out[o++] = static_cast<char16_t>(0xDC00 | (cp & 0x3FF));
+  }
+  else
+    out[o++] = static_cast<char16_t>(cp);
+
+  i += n;
+  return true;
+}
+
+size_t utf8_to_utf16_reference(char16_t* out, u8 const* in, size_t len) {
+  size_t i = 0, o = 0;
+
+  while( i < len ) {
+    if( !decode_one(in, len, i, out, o) )
+      return npos;
+  }
+
+  return o;
+}
+
+#if METRO_UTF_X86
+
+// SSE2 is always available on x86-64
+static size_t utf8_to_utf16_sse2(char16_t* out, u8 const* in, size_t len) {
+  size_t i = 0, o = 0;
+
+  while( i < len ) {
+    // ASCII run: 16 bytes => 16 code units
+    while( i + 16 <= len ) {
+      __m128i v = _mm_loadu_si128((__m128i const*)(in + i));
+
+      // copy the ASCII prefix of this block
+      if( int mask = _mm_movemask_epi8(v); mask ) {
+        for( int n = __builtin_ctz(mask); n--; )
+          out[o++] = in[i++];
+
+        break;
+      }
+
+      __m128i zero = _mm_setzero_si128();
+
+      _mm_storeu_si128((__m128i*)(out + o), _mm_unpacklo_epi8(v, zero));
+      _mm_storeu_si128((__m128i*)(out + o + 8), _mm_unpackhi_epi8(v, zero));
+
+      i += 16;
+      o += 16;
+    }
+
+    if( i >= len )
+      break;
+
+    // non-ASCII run by scalar, then try the vector path again
+    do {
+      if( !decode_one(in, len, i, out, o) )
+        return npos;
+    } while( i < len && in[i] >= 0x80 );
+  }
+
+  return o;
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_to_utf16_avx2(char16_t* out, u8 const* in, size_t len) {
+  size_t i = 0, o = 0;
+
+  while( i < len ) {
+    // ASCII run: 32 bytes => 32 code units
+    while( i + 32 <= len ) {
+      __m256i v = _mm256_loadu_si256((__m256i const*)(in + i));
+
+      // copy the ASCII prefix of this block
+      if( u32 mask = _mm256_movemask_epi8(v); mask ) {
+        for( int n = __builtin_ctz(mask); n--; )
+          out[o++] = in[i++];
+
+        break;
+      }
+
+      _mm256_storeu_si256((__m256i*)(out + o),
+        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+
+      _mm256_storeu_si256((__m256i*)(out + o + 16),
+        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+
+      i += 32;
+      o += 32;
+    }
+
+    // tail of ASCII run shorter than 32 bytes
+    while( i < len && in[i] < 0x80 )
+      out[o++] = in[i++];
+
+    if( i >= len )
+      break;
+
+    do {
+      if( !decode_one(in, len, i, out, o) )
+        return npos;
+    } while( i < len && in[i] >= 0x80 );
+  }
+
+  return o;
+}
+
+#endif
+
+using Converter = size_t (*)(char16_t*, u8 const*, size_t);
+
+static Converter select_converter() {
+#if METRO_UTF_X86
+  __builtin_cpu_init();
+
+  if( __builtin_cpu_supports("avx2") )
+    return utf8_to_utf16_avx2;
+
+  return utf8_to_utf16_sse2;
+#else
+  return utf8_to_utf16_reference;
+#endif
+}
+
+size_t utf8_to_utf16(char16_t* out, u8 const* in, size_t len) {
+  static Converter const conv = select_converter();
+
+  size_t ret = conv(out, in, len);
+
+  // validate against the reference implementation
+  debug(
+    std::u16string ref(len, 0);
+
+    if( utf8_to_utf16_reference(ref.data(), in, len) != ret
+        || (ret != npos && memcmp(ref.data(), out, ret * sizeof(char16_t))) )
+      panic("utf8_to_utf16: result differs from reference");
+  )
+
+  return ret;
+}
+
+bool utf8_to_utf16(std::u16string& out, std::string_view in) {
+  // UTF-16 never needs more code units than UTF-8 bytes
+  out.resize(in.length());
+
+  size_t len = utf8_to_utf16(out.data(), (u8 const*)in.data(), in.length());
+
+  if( len == npos )
+    return false;
+
+  out.resize(len);
+  return true;
+}
+
+} // namespace metro::utf